@@ -0,0 +1,327 @@
+#include "curvesampler.h"
+#include "expressionset.h"
+#include "quantilesketch.h"
+#include <QtGlobal>
+#include <QtMath>
+#include <cmath>
+#include <queue>
+#include <vector>
+
+namespace {
+// Spacing of the starting grid, in pixels.
+const double GridSpacing = 4;
+// Intervals narrower than this fraction of a pixel are not split further.
+const double MinWidth = 1.0 / 1024;
+// Where a midpoint was this many pixels off, the curve may be oscillating
+// faster than the samples can tell, and the midpoints of the halves can
+// land near the line by chance. Their halves are only taken as straight
+// once they are at most a pixel wide.
+const double SuspectError = 4;
+
+// Point i of a grid of steps intervals from from to to. The points inside
+// are nudged off an even spacing, so that a periodic function cannot hide
+// by having a zero on every grid point.
+double gridX(double from, double to, int steps, int i)
+{
+    if (i == steps) return to;
+    const double step = (to - from) / steps;
+    double x = from + i * step;
+    if (i > 0) {
+        const double golden = 0.6180339887498949 * i;
+        x += (golden - std::floor(golden) - 0.5) * 0.25 * step;
+    }
+    return x;
+}
+
+// How many intervals of about GridSpacing pixels span width pixels.
+int gridSteps(double width)
+{
+    return qMax(1, int(std::ceil(width / GridSpacing)));
+}
+
+// A sample, with the probe of the interval that starts at it.
+struct Point {
+    double x;
+    double y;
+    int next; // index of the next point in x order, -1 after the last
+    double probeX; // NaN for none
+    double probeY;
+};
+
+// An interval, by the point it starts at, not yet good enough to draw as a
+// single segment.
+struct Interval {
+    double error; // pixels
+    int left;
+    bool operator<(const Interval &o) const { return error < o.error; }
+};
+} // namespace
+
+CurveSampler::CurveSampler(const ExpressionParser &parser)
+    : m_parser(parser)
+{
+}
+
+CurveSampler::Curve CurveSampler::sample(double xMin, double xMax, double yMin, double yMax,
+                                         const QSizeF &plotSize, const Curve &known) const
+{
+    Curve result;
+    if (!m_parser.isValid() || !(xMin < xMax) || !(yMin < yMax)
+        || !std::isfinite(xMax - xMin) || !std::isfinite(yMax - yMin)) {
+        result.complete = true;
+        return result;
+    }
+    // A hidden widget may not have a size yet; assume a small plot.
+    const double width = qMax(plotSize.width(), 64.0);
+    const double height = qMax(plotSize.height(), 64.0);
+    const double sx = width / (xMax - xMin);
+    const double sy = height / (yMax - yMin);
+    const double minWidth = MinWidth / sx;
+
+    // The starting points in x order. Values not known yet are listed in
+    // pending, as the index of their point or, for a probe, minus one less
+    // the index of the point it belongs to, and evaluated in one batch.
+    QVector<Point> points;
+    QVector<int> pending;
+    const QPointF noProbe(qQNaN(), qQNaN());
+    auto append = [&](double x, double y, bool evaluated, const QPointF &probe) {
+        if (!points.isEmpty()) {
+            Point &last = points.last();
+            if (std::isnan(probe.x())) {
+                last.probeX = (last.x + x) / 2;
+                pending.append(-points.size());
+            } else {
+                last.probeX = probe.x();
+                last.probeY = probe.y();
+            }
+        }
+        points.append({ x, y, -1, qQNaN(), qQNaN() });
+        if (!evaluated)
+            pending.append(points.size() - 1);
+    };
+    // Lays a grid over [from, to], with from and to themselves only when
+    // asked to. A stretch where f is undefined throughout, or stays above
+    // or below the plot, gets no points inside.
+    auto appendGrid = [&](double from, double to, bool withFrom, bool withTo) {
+        int steps = gridSteps((to - from) * sx);
+        if (steps > 1) {
+            const ExpressionParser::Interval range = m_parser.evalInterval(from, to);
+            if (range.isEmpty() || range.lo > yMax || range.hi < yMin)
+                steps = 1;
+        }
+        for (int i = withFrom ? 0 : 1; i <= (withTo ? steps : steps - 1); ++i)
+            append(gridX(from, to, steps, i), 0, false, noProbe);
+    };
+
+    int first = 0;
+    while (first < known.points.size() && known.points[first].x() < xMin)
+        ++first;
+    int last = known.points.size() - 1;
+    while (last >= first && known.points[last].x() > xMax)
+        --last;
+    const bool haveProbes = known.probes.size() == known.points.size() - 1;
+    if (first > last) {
+        appendGrid(xMin, xMax, true, true);
+    } else {
+        if (known.points[first].x() > xMin)
+            appendGrid(xMin, known.points[first].x(), true, false);
+        bool merged = false;
+        for (int i = first; i <= last; ++i) {
+            const QPointF &pt = known.points[i];
+            QPointF probe = i > first && haveProbes ? known.probes[i - 1] : noProbe;
+            // Zoomed out, the known points can be far denser than a fresh
+            // grid. Two neighbouring intervals become one, with the point
+            // between them as its probe, as long as that is no wider than
+            // the grid spacing and the point, in the middle half of it, is
+            // well within the tolerance of the merged segment. Merged
+            // intervals are not merged again in the same pass, as the probe
+            // only vouches for its halves.
+            const int n = points.size();
+            if (i > first + 1 && !merged && std::isfinite(pt.y()) && std::isfinite(points[n - 1].y)
+                && std::isfinite(points[n - 2].y) && (pt.x() - points[n - 2].x) * sx <= GridSpacing
+                && std::abs(2 * points[n - 1].x - points[n - 2].x - pt.x()) <= (pt.x() - points[n - 2].x) / 2) {
+                const Point &a = points[n - 2], &m = points[n - 1];
+                const double dx = (pt.x() - a.x) * sx, dy = (pt.y() - a.y) * sy;
+                const double mdx = (m.x - a.x) * sx, mdy = (m.y - a.y) * sy;
+                merged = std::abs(dx * mdy - dy * mdx) <= m_tolerance / 2 * std::hypot(dx, dy);
+            } else {
+                merged = false;
+            }
+            if (merged) {
+                probe = QPointF(points[n - 1].x, points[n - 1].y);
+                points.removeLast();
+            }
+            append(pt.x(), pt.y(), true, probe);
+        }
+        if (known.points[last].x() < xMax)
+            appendGrid(known.points[last].x(), xMax, false, true);
+    }
+    if (!pending.isEmpty()) {
+        QVector<double> xs(pending.size());
+        QVector<double> ys(pending.size());
+        for (int i = 0; i < pending.size(); ++i)
+            xs[i] = pending[i] >= 0 ? points[pending[i]].x : points[-pending[i] - 1].probeX;
+        m_parser.evalBatch(xs.constData(), ys.data(), xs.size());
+        for (int i = 0; i < pending.size(); ++i) {
+            if (pending[i] >= 0)
+                points[pending[i]].y = ys[i];
+            else
+                points[-pending[i] - 1].probeY = ys[i];
+        }
+    }
+    const int startCount = points.size();
+    for (int i = 0; i + 1 < startCount; ++i)
+        points[i].next = i + 1;
+    points.reserve(qMax(startCount, m_maxPoints));
+
+    // True when f may be unbounded somewhere in [a, b], that is when the
+    // interval could hold a pole.
+    auto unbounded = [this](double a, double b) {
+        const ExpressionParser::Interval range = m_parser.evalInterval(a, b);
+        return !range.isEmpty() && (std::isinf(range.lo) || std::isinf(range.hi));
+    };
+    // How far, in pixels, the curve strays from the segment that starts at
+    // point l, judging by its probe; infinite when that cannot be told.
+    auto error = [&](int l) {
+        const Point &a = points[l];
+        const Point &b = points[a.next];
+        const double mx = a.probeX, my = a.probeY;
+        const bool nanA = std::isnan(a.y), nanM = std::isnan(my), nanB = std::isnan(b.y);
+        if (nanA && nanM && nanB)
+            return 0.0;
+        if (nanA || nanM || nanB || std::isinf(a.y) || std::isinf(my) || std::isinf(b.y))
+            return qInf();
+        // Off the plot, above or below it, the shape does not matter as
+        // long as the curve cannot come back into view in between.
+        if ((a.y > yMax && my > yMax && b.y > yMax) || (a.y < yMin && my < yMin && b.y < yMin)) {
+            const ExpressionParser::Interval range = m_parser.evalInterval(a.x, b.x);
+            if (range.lo > yMax || range.hi < yMin)
+                return 0.0;
+        }
+        const double dx = (b.x - a.x) * sx, dy = (b.y - a.y) * sy;
+        const double mdx = (mx - a.x) * sx, mdy = (my - a.y) * sy;
+        const double length = std::hypot(dx, dy);
+        double distance = length > 0 ? std::abs(dx * mdy - dy * mdx) / length : std::hypot(mdx, mdy);
+        // A pole can sit between two samples with the midpoint by chance
+        // close to the line; a segment that crosses the whole plot is only
+        // trusted where f is known to stay bounded.
+        if (std::abs(dy) > height && unbounded(a.x, b.x))
+            distance = qInf();
+        return distance;
+    };
+
+    std::priority_queue<Interval> queue;
+    // Inserts a NaN point at the probe of the interval that starts at l,
+    // so that no line is drawn across it.
+    auto breakAfter = [&](int l) {
+        const Point &a = points[l];
+        points.append({ a.probeX, qQNaN(), a.next, qQNaN(), qQNaN() });
+        points[l].next = points.size() - 1;
+        points[l].probeX = qQNaN();
+    };
+    // Queues the interval that starts at l for splitting, or settles it
+    // when it is good enough or too narrow to split. A narrow interval
+    // that still looks bad is either a pole, which gets a gap, or an
+    // oscillation too fast to follow.
+    auto consider = [&](int l, double parentError) {
+        const double e = error(l);
+        const double a = points[l].x, b = points[points[l].next].x, mx = points[l].probeX;
+        if (e <= m_tolerance && (parentError <= SuspectError || (b - a) * sx <= 1))
+            return;
+        if (b - a <= minWidth || !(a < mx && mx < b)) {
+            if (std::isfinite(points[l].y) && std::isfinite(points[points[l].next].y)
+                && unbounded(a, b) && points.size() < m_maxPoints)
+                breakAfter(l);
+            return;
+        }
+        queue.push({ e, l });
+    };
+    for (int i = 0; i + 1 < startCount; ++i)
+        consider(i, 0);
+
+    // Worst first, so that a spent budget leaves the smallest errors. Each
+    // split adds the probe as a point and may add a gap after each half.
+    while (!queue.empty() && points.size() + 3 <= m_maxPoints) {
+        const Interval in = queue.top();
+        queue.pop();
+        const Point a = points[in.left];
+        points.append({ a.probeX, a.probeY, a.next, (a.probeX + points[a.next].x) / 2, 0 });
+        const int m = points.size() - 1;
+        points[m].probeY = m_parser.eval(points[m].probeX);
+        points[in.left].next = m;
+        points[in.left].probeX = (a.x + a.probeX) / 2;
+        points[in.left].probeY = m_parser.eval(points[in.left].probeX);
+        consider(in.left, in.error);
+        consider(m, in.error);
+    }
+    result.complete = queue.empty();
+    // Out of budget: still cut the curve at any pole left unresolved.
+    while (!queue.empty() && points.size() < m_maxPoints) {
+        const Interval in = queue.top();
+        queue.pop();
+        const Point &a = points[in.left];
+        if (std::isfinite(a.y) && std::isfinite(points[a.next].y) && unbounded(a.x, points[a.next].x))
+            breakAfter(in.left);
+    }
+
+    // One NaN is enough to cut the curve; of a run of them, as where f is
+    // undefined, only the first and last are kept, the stretch between
+    // them judged undefined throughout.
+    result.points.reserve(points.size());
+    result.probes.reserve(points.size());
+    QPointF probe;
+    for (int i = 0; i >= 0; i = points[i].next) {
+        const Point &pt = points[i];
+        const int n = result.points.size();
+        if (std::isnan(pt.y) && n >= 2 && std::isnan(result.points[n - 1].y())
+            && std::isnan(result.points[n - 2].y())) {
+            result.points.last() = QPointF(pt.x, pt.y);
+            result.probes.last() = QPointF((result.points[n - 2].x() + pt.x) / 2, qQNaN());
+        } else {
+            if (n > 0)
+                result.probes.append(probe);
+            result.points.append(QPointF(pt.x, pt.y));
+        }
+        probe = QPointF(pt.probeX, pt.probeY);
+    }
+    return result;
+}
+
+// The points of the grid and the midpoints between them go into one array
+// of x, so that the set computes each x, and whatever its expressions
+// share, once for all of them.
+QVector<CurveSampler::Curve> CurveSampler::sampleGrid(const ExpressionSet &set, double xMin, double xMax,
+                                                      const QSizeF &plotSize, QuantileSketch *ySketch)
+{
+    QVector<Curve> curves(set.count());
+    if (set.count() == 0 || !(xMin < xMax) || !std::isfinite(xMax - xMin))
+        return curves;
+    const int steps = gridSteps(qMax(plotSize.width(), 64.0));
+    QVector<double> xs(2 * steps + 1);
+    for (int i = 0; i <= steps; ++i)
+        xs[2 * i] = gridX(xMin, xMax, steps, i);
+    for (int i = 0; i < steps; ++i)
+        xs[2 * i + 1] = (xs[2 * i] + xs[2 * i + 2]) / 2;
+
+    QVector<QVector<double>> values(set.count(), QVector<double>(xs.size()));
+    QVector<double *> out(set.count());
+    for (int e = 0; e < set.count(); ++e)
+        out[e] = values[e].data();
+    set.evalBatch(xs.constData(), out.constData(), xs.size());
+
+    for (int e = 0; e < set.count(); ++e) {
+        Curve &curve = curves[e];
+        curve.points.reserve(steps + 1);
+        curve.probes.reserve(steps);
+        for (int i = 0; i < xs.size(); ++i) {
+            const double y = values[e][i];
+            if (ySketch)
+                ySketch->add(y);
+            if (i % 2 == 0)
+                curve.points.append(QPointF(xs[i], y));
+            else
+                curve.probes.append(QPointF(xs[i], y));
+        }
+    }
+    return curves;
+}
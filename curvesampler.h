@@ -0,0 +1,79 @@
+#ifndef CURVESAMPLER_H
+#define CURVESAMPLER_H
+
+#include "expressionparser.h"
+#include <QPointF>
+#include <QSizeF>
+#include <QVector>
+
+class ExpressionSet;
+class QuantileSketch;
+
+// Chooses where to evaluate y = f(x) for a 2D plot. Starting from a coarse
+// grid, the sampler keeps splitting the interval whose midpoint strays
+// furthest from the straight segment between its ends, measured in pixels
+// on the plot, until every segment is within the tolerance or the point
+// budget is spent. Straight stretches end up with a sample every few
+// pixels, bends and steep parts with as many as they need.
+//
+// Where the curve goes through a pole, as tan(x) does at pi/2, the samples
+// on either side are separated by a point with y NaN, which the plot
+// treats as a gap instead of drawing a line across.
+class CurveSampler
+{
+public:
+    // Samples in increasing x. probes[i] is the point of the curve between
+    // points[i] and points[i + 1] by which that stretch was judged, or NaN
+    // in x where there is none, so that the samples can be judged again
+    // for another view without evaluating f.
+    // complete is false when the budget ran out with stretches still
+    // judged too coarse, or for a starting grid; passed back to sample()
+    // with a larger budget, such a curve is refined further.
+    struct Curve {
+        QVector<QPointF> points;
+        QVector<QPointF> probes;
+        bool complete = false;
+    };
+
+    static const int DefaultMaxPoints = 8192;
+
+    explicit CurveSampler(const ExpressionParser &parser);
+
+    // Largest distance, in pixels, between the curve and the segments
+    // drawn for it. 0.5 by default.
+    void setTolerance(double pixels) { m_tolerance = pixels; }
+    double tolerance() const { return m_tolerance; }
+    // Most points sample() returns, gaps included, besides the starting
+    // grid and the known points it keeps. DefaultMaxPoints by default.
+    void setMaxPoints(int count) { m_maxPoints = qMax(count, 3); }
+    int maxPoints() const { return m_maxPoints; }
+
+    // Samples [xMin, xMax] for a plot of plotSize pixels that shows y in
+    // [yMin, yMax]. Points of known that fall in the range, such as those
+    // of the view before a zoom or pan, are reused along with their
+    // probes: f is only evaluated on stretches known does not cover and
+    // where the known samples are too coarse for the new view. Where they
+    // are denser than needed, some are dropped.
+    Curve sample(double xMin, double xMax, double yMin, double yMax, const QSizeF &plotSize,
+                 const Curve &known) const;
+    Curve sample(double xMin, double xMax, double yMin, double yMax, const QSizeF &plotSize) const
+    {
+        return sample(xMin, xMax, yMin, yMax, plotSize, Curve());
+    }
+
+    // The starting grid of sample() over [xMin, xMax] for every expression
+    // of set at once, in one batch pass: each x is computed once, and so
+    // is every subexpression the expressions have in common. Passed to
+    // sample() as known, a curve only needs refining. The values of all of
+    // them, grid points and probes, are added to ySketch if given, in the
+    // same sweep.
+    static QVector<Curve> sampleGrid(const ExpressionSet &set, double xMin, double xMax,
+                                     const QSizeF &plotSize, QuantileSketch *ySketch = nullptr);
+
+private:
+    ExpressionParser m_parser;
+    double m_tolerance = 0.5;
+    int m_maxPoints = DefaultMaxPoints;
+};
+
+#endif // CURVESAMPLER_H
@@ -1,6 +1,13 @@
 #include "expressionparser.h"
+#include "nativecode.h"
+#include "vectormath.h"
 #include <QtGlobal>
+#include <QtMath>
+#include <QVarLengthArray>
+#include <algorithm>
 #include <cmath>
+#include <cstring>
+#include <limits>
 
 namespace {
 double safeLog(double x) {
@@ -11,46 +18,135 @@ double safeSqrt(double x) {
     if (x < 0) return qQNaN();
     return std::sqrt(x);
 }
+const int MaxPowIntExponent = 16;
+
+// Bounds the recursion of the parser, so that a thousand opening
+// parentheses are an error rather than a stack overflow.
+const int MaxNesting = 1000;
+struct Nesting {
+    explicit Nesting(int &depth) : depth(depth) { ++depth; }
+    ~Nesting() { --depth; }
+    int &depth;
+};
 } // namespace
 
-ExpressionParser::Node::~Node()
+// Nodes hold no resources of their own, so dropping them is a single
+// truncation of m_nodes that keeps its capacity for the next parse.
+void ExpressionParser::clearNodes()
 {
-    delete left;
-    delete right;
+    m_nodes.clear();
+    m_nodeIndex.clear();
+    m_root = -1;
 }
 
-void ExpressionParser::skipSpaces()
+int ExpressionParser::makeNode(Node::Type type, int left, int right, double value)
 {
-    while (m_pos < m_input.size() && m_input[m_pos].isSpace())
-        ++m_pos;
+    NodeKey key = { type, 0, left, right };
+    std::memcpy(&key.valueBits, &value, sizeof(value));
+    const int existing = m_nodeIndex.value(key, -1);
+    if (existing >= 0)
+        return existing;
+    Node n;
+    n.type = type;
+    n.value = value;
+    n.left = left;
+    n.right = right;
+    m_nodes.append(n);
+    m_nodeIndex.insert(key, m_nodes.size() - 1);
+    return m_nodes.size() - 1;
+}
+
+// Splits m_input into m_tokens in one pass, ending with an End token.
+// LaTeX spellings such as \sin and \ln are read as the function they name.
+void ExpressionParser::tokenize()
+{
+    static const struct { const char *spelling; Node::Type type; const char *name; bool latexOnly; } functions[] = {
+        { "sin", Node::Sin, "sin", false }, { "cos", Node::Cos, "cos", false },
+        { "tan", Node::Tan, "tan", false }, { "sqrt", Node::Sqrt, "sqrt", false },
+        { "exp", Node::Exp, "exp", false }, { "log", Node::Log, "log", false },
+        { "ln", Node::Log, "log", true }
+    };
+    const QStringView input(m_input);
+    const int size = input.size();
+    m_tokens.clear();
+    int pos = 0;
+    while (true) {
+        while (pos < size && input[pos].isSpace())
+            ++pos;
+        Token t = { Token::End, pos, 0, Node::Number, nullptr };
+        if (pos == size) {
+            m_tokens.append(t);
+            return;
+        }
+        const QChar c = input[pos];
+        int length = 1;
+        switch (c.unicode()) {
+        case 'x': case 'X': t.kind = Token::X; break;
+        case 'y': case 'Y': t.kind = Token::Y; break;
+        case '+': t.kind = Token::Plus; break;
+        case '-': t.kind = Token::Minus; break;
+        case '*': t.kind = Token::Star; break;
+        case '/': t.kind = Token::Slash; break;
+        case '^': t.kind = Token::Caret; break;
+        case '(': t.kind = Token::LeftParen; break;
+        case ')': t.kind = Token::RightParen; break;
+        default:
+            t.kind = Token::Invalid;
+            if (c.isDigit() || (c == QLatin1Char('.') && pos + 1 < size && input[pos + 1].isDigit())) {
+                while (pos + length < size && (input[pos + length].isDigit() || input[pos + length] == QLatin1Char('.')))
+                    ++length;
+                bool ok = false;
+                t.value = input.mid(pos, length).toDouble(&ok);
+                t.kind = ok ? Token::Number : Token::BadNumber;
+                break;
+            }
+            // Plain names match in any case, LaTeX ones only as written.
+            const bool latex = c == QLatin1Char('\\');
+            const QStringView rest = input.mid(latex ? pos + 1 : pos);
+            for (const auto &f : functions) {
+                if (f.latexOnly && !latex)
+                    continue;
+                if (rest.startsWith(QLatin1String(f.spelling), latex ? Qt::CaseSensitive : Qt::CaseInsensitive)) {
+                    t.kind = Token::Function;
+                    t.function = f.type;
+                    t.name = f.name;
+                    length = int(std::strlen(f.spelling)) + (latex ? 1 : 0);
+                    break;
+                }
+            }
+            break;
+        }
+        m_tokens.append(t);
+        pos += length;
+    }
 }
 
 bool ExpressionParser::parse(const QString &expr)
 {
     m_parsed = false;
-    delete m_root;
-    m_root = nullptr;
+    m_native.reset();
+    clearNodes();
+    m_eliminatedNodes = 0;
     m_error.clear();
-    QString normalized = expr.trimmed();
-    normalized.replace(QStringLiteral("\\sin"), QStringLiteral("sin"));
-    normalized.replace(QStringLiteral("\\cos"), QStringLiteral("cos"));
-    normalized.replace(QStringLiteral("\\tan"), QStringLiteral("tan"));
-    normalized.replace(QStringLiteral("\\sqrt"), QStringLiteral("sqrt"));
-    normalized.replace(QStringLiteral("\\exp"), QStringLiteral("exp"));
-    normalized.replace(QStringLiteral("\\log"), QStringLiteral("log"));
-    normalized.replace(QStringLiteral("\\ln"), QStringLiteral("log"));
-    m_input = normalized;
-    m_pos = 0;
-
-    Node *root = parseExpression();
-    skipSpaces();
-    if (m_pos != m_input.size() && m_error.isEmpty())
+    m_input = expr;
+    tokenize();
+    m_token = 0;
+    m_depth = 0;
+    m_nodes.reserve(m_tokens.size());
+
+    int root = parseExpression();
+    if (m_tokens[m_token].kind != Token::End && m_error.isEmpty())
         m_error = QStringLiteral("Unexpected character at end");
+    m_tokens.clear();
     if (!m_error.isEmpty()) {
-        delete root;
+        clearNodes();
         return false;
     }
-    m_root = root;
+    m_root = m_optimize ? optimize(root) : root;
+    m_nodeIndex.clear();
+    m_resultRegister = compile({ m_root }).first();
+    if (m_nativeEnabled)
+        compileNative();
     m_parsed = true;
     return true;
 }
@@ -62,258 +158,1068 @@ double ExpressionParser::eval(double x) const
 
 double ExpressionParser::eval(double x, double y) const
 {
-    if (!m_root) return qQNaN();
-    return evalNode(m_root, x, y);
+    if (m_root < 0) return qQNaN();
+    QVarLengthArray<double, 64> regs(m_registerCount);
+    if (m_native)
+        return m_native->function()(x, y, regs.data());
+    regs[0] = x;
+    regs[1] = y;
+    std::copy(m_constants.cbegin(), m_constants.cend(), regs.data() + m_constantBase);
+    return run(regs.data());
+}
+
+ExpressionParser::Gradient ExpressionParser::evalGradient(double x) const
+{
+    return evalGradient(x, 0);
 }
 
-double ExpressionParser::evalNode(const Node *n, double x, double y) const
+// Runs the program with every register carrying its derivatives along.
+// Unary steps scale the derivatives of their operand by their own slope.
+// An operand that does not depend on a variable contributes nothing for
+// it, even where that slope is infinite, as for sqrt(y) at y = 0.
+ExpressionParser::Gradient ExpressionParser::evalGradient(double x, double y) const
 {
-    if (!n) return qQNaN();
-    switch (n->type) {
-    case Node::Number: return n->value;
+    if (m_root < 0) return { qQNaN(), qQNaN(), qQNaN() };
+    QVarLengthArray<Gradient, 64> regs(m_registerCount);
+    regs[0] = { x, 1, 0 };
+    regs[1] = { y, 0, 1 };
+    for (int c = 0; c < m_constants.size(); ++c)
+        regs[m_constantBase + c] = { m_constants[c], 0, 0 };
+
+    auto chain = [](double slope, double d) { return d == 0 ? 0 : slope * d; };
+    auto scaled = [&](double v, double slope, const Gradient &a) {
+        return Gradient{ v, chain(slope, a.dx), chain(slope, a.dy) };
+    };
+    for (const Instr &in : m_program) {
+        const Gradient &a = regs[in.a];
+        const Gradient &b = regs[in.op == Node::PowInt ? in.a : in.b];
+        Gradient r;
+        switch (in.op) {
+        case Node::Add: r = { a.value + b.value, a.dx + b.dx, a.dy + b.dy }; break;
+        case Node::Sub: r = { a.value - b.value, a.dx - b.dx, a.dy - b.dy }; break;
+        case Node::Mul:
+            r = { a.value * b.value, a.dx * b.value + a.value * b.dx, a.dy * b.value + a.value * b.dy };
+            break;
+        case Node::Div: {
+            const double v = b.value == 0 ? qQNaN() : a.value / b.value;
+            r = { v, (a.dx - v * b.dx) / b.value, (a.dy - v * b.dy) / b.value };
+            break;
+        }
+        case Node::Pow: {
+            // d(a^b) = b a^(b-1) da + a^b log(a) db, each term only when
+            // its operand varies, so that negative bases keep a slope.
+            const double v = std::pow(a.value, b.value);
+            const double da = a.dx != 0 || a.dy != 0 ? b.value * std::pow(a.value, b.value - 1) : 0;
+            const double db = b.dx != 0 || b.dy != 0 ? v * safeLog(a.value) : 0;
+            r = { v, chain(da, a.dx) + chain(db, b.dx), chain(da, a.dy) + chain(db, b.dy) };
+            break;
+        }
+        case Node::PowInt:
+            r = scaled(VectorMath::scalarPowInt(a.value, in.b),
+                       in.b ? in.b * VectorMath::scalarPowInt(a.value, in.b - 1) : 0, a);
+            break;
+        case Node::Negate: r = { -a.value, -a.dx, -a.dy }; break;
+        case Node::Sin: r = scaled(std::sin(a.value), std::cos(a.value), a); break;
+        case Node::Cos: r = scaled(std::cos(a.value), -std::sin(a.value), a); break;
+        case Node::Tan: {
+            const double v = std::tan(a.value);
+            r = scaled(v, 1 + v * v, a);
+            break;
+        }
+        case Node::Sqrt: {
+            const double v = safeSqrt(a.value);
+            r = scaled(v, 0.5 / v, a);
+            break;
+        }
+        case Node::Exp: {
+            const double v = std::exp(a.value);
+            r = scaled(v, v, a);
+            break;
+        }
+        case Node::Log: r = scaled(safeLog(a.value), 1 / a.value, a); break;
+        default: r = { qQNaN(), qQNaN(), qQNaN() }; break;
+        }
+        if (std::isnan(r.value))
+            r.dx = r.dy = r.value;
+        regs[in.dst] = r;
+    }
+    return regs[m_resultRegister];
+}
+
+void ExpressionParser::evalBatch(const double *xs, double *out, int count) const
+{
+    evalBatch(xs, nullptr, out, count);
+}
+
+void ExpressionParser::evalBatch(const double *xs, const double *ys, double *out, int count) const
+{
+    if (count <= 0) return;
+    if (m_root < 0) {
+        std::fill(out, out + count, qQNaN());
+        return;
+    }
+
+    // Every register becomes a column of BatchBlock values. x and y point
+    // straight into the caller's arrays, constants are broadcast once, and
+    // the last instruction writes its column directly into out.
+    const int block = qMin(count, BatchBlock);
+    QVector<double> storage((m_registerCount - 1) * block);
+    double *zeros = storage.data();
+    QVarLengthArray<double *, 64> cols(m_registerCount);
+    for (int r = 2; r < m_registerCount; ++r)
+        cols[r] = storage.data() + (r - 1) * block;
+    for (int c = 0; c < m_constants.size(); ++c)
+        std::fill(cols[m_constantBase + c], cols[m_constantBase + c] + block, m_constants[c]);
+
+    const VectorMath::Kernels &k = VectorMath::kernels();
+    for (int base = 0; base < count; base += block) {
+        const int n = qMin(block, count - base);
+        cols[0] = const_cast<double *>(xs + base);
+        cols[1] = ys ? const_cast<double *>(ys + base) : zeros;
+        for (int i = 0; i < m_program.size(); ++i) {
+            const Instr &in = m_program[i];
+            const double *b = in.op == Node::PowInt ? nullptr : cols[in.b];
+            double *r = i + 1 == m_program.size() ? out + base : cols[in.dst];
+            runKernel(k, in, cols[in.a], b, r, n);
+        }
+        if (m_program.isEmpty())
+            std::copy(cols[m_resultRegister], cols[m_resultRegister] + n, out + base);
+    }
+}
+
+void ExpressionParser::evalGrid(const double *xs, int nx, const double *ys, int ny, double *out) const
+{
+    if (nx <= 0 || ny <= 0) return;
+    if (m_root < 0) {
+        std::fill(out, out + nx * ny, qQNaN());
+        return;
+    }
+
+    // Give every value its own slot: 0 is x, 1 is y, then the constants,
+    // then one per instruction. The register file cannot be used as is,
+    // because the instructions are run grouped by what they depend on
+    // rather than in program order.
+    enum Dep { None = 0, DepX = 1, DepY = 2, Both = 3 };
+    const int constBase = 2;
+    const int instrBase = constBase + m_constants.size();
+    const int slotCount = instrBase + m_program.size();
+    QVector<int> regSlot(m_registerCount);
+    regSlot[0] = 0;
+    regSlot[1] = 1;
+    for (int c = 0; c < m_constants.size(); ++c)
+        regSlot[m_constantBase + c] = constBase + c;
+    QVector<Instr> program = m_program;
+    QVector<int> dep(slotCount, None);
+    dep[0] = DepX;
+    dep[1] = DepY;
+    for (int i = 0; i < program.size(); ++i) {
+        Instr &in = program[i];
+        in.a = regSlot[in.a];
+        if (in.op != Node::PowInt)
+            in.b = regSlot[in.b];
+        dep[instrBase + i] = dep[in.a] | (in.op == Node::PowInt ? None : dep[in.b]);
+        regSlot[in.dst] = instrBase + i;
+        in.dst = instrBase + i;
+    }
+    const int result = regSlot[m_resultRegister];
+
+    // Mixed values are computed a block of cells at a time: several whole
+    // rows when rows are short, otherwise a piece of one row.
+    const int rowsPerBlock = qMax(1, GridBlock / ny);
+    const int span = qMin(ny, GridBlock);
+    const int block = rowsPerBlock * span;
+
+    // Columns: constant values are broadcast over the longest axis or a
+    // whole block, whichever is longer, x-only values hold one entry per
+    // row, y-only values one per column, and mixed values one block. A
+    // mixed instruction reads x-only values from a block refilled for
+    // every block of rows, and y-only values straight from their column
+    // or, with several rows per block, from a copy repeated once per row.
+    const int longest = qMax(qMax(nx, ny), block);
+    QVector<int> offset(slotCount, -1);
+    int size = 0;
+    for (int s = constBase; s < slotCount; ++s) {
+        offset[s] = size;
+        size += dep[s] == None ? longest : dep[s] == DepX ? nx : dep[s] == DepY ? ny : block;
+    }
+    QVector<int> perBlock;
+    QVector<int> blockOffset(slotCount, -1);
+    auto addPerBlock = [&](int s) {
+        if (blockOffset[s] >= 0 || dep[s] == None || dep[s] == Both) return;
+        if (dep[s] == DepY && rowsPerBlock == 1) return;
+        blockOffset[s] = size;
+        size += block;
+        perBlock.append(s);
+    };
+    for (const Instr &in : program) {
+        if (dep[in.dst] != Both) continue;
+        addPerBlock(in.a);
+        if (in.op != Node::PowInt)
+            addPerBlock(in.b);
+    }
+    QVector<double> storage(size);
+    auto column = [&](int s) -> double * {
+        return s == 0 ? const_cast<double *>(xs) : s == 1 ? const_cast<double *>(ys)
+                                                          : storage.data() + offset[s];
+    };
+    for (int c = 0; c < m_constants.size(); ++c)
+        std::fill(column(constBase + c), column(constBase + c) + longest, m_constants[c]);
+
+    const VectorMath::Kernels &k = VectorMath::kernels();
+    const int lengthOf[] = { longest, nx, ny };
+    for (int pass = None; pass <= DepY; ++pass) {
+        for (const Instr &in : program) {
+            if (dep[in.dst] == pass)
+                runKernel(k, in, column(in.a), in.op == Node::PowInt ? nullptr : column(in.b),
+                          column(in.dst), lengthOf[pass]);
+        }
+    }
+
+    if (dep[result] != Both) {
+        for (int i = 0; i < nx; ++i) {
+            double *row = out + i * ny;
+            if (dep[result] == None) std::fill(row, row + ny, column(result)[0]);
+            else if (dep[result] == DepX) std::fill(row, row + ny, column(result)[i]);
+            else std::copy(column(result), column(result) + ny, row);
+        }
+        return;
+    }
+
+    for (int s : perBlock) {
+        if (dep[s] != DepY) continue;
+        for (int r = 0; r < rowsPerBlock; ++r)
+            std::copy(column(s), column(s) + ny, storage.data() + blockOffset[s] + r * ny);
+    }
+    for (int i = 0; i < nx; i += rowsPerBlock) {
+        const int rows = qMin(rowsPerBlock, nx - i);
+        for (int s : perBlock) {
+            if (dep[s] != DepX) continue;
+            double *b = storage.data() + blockOffset[s];
+            for (int r = 0; r < rows; ++r)
+                std::fill(b + r * span, b + (r + 1) * span, column(s)[i + r]);
+        }
+        for (int base = 0; base < rows * ny; base += block) {
+            const int n = qMin(block, rows * ny - base);
+            auto operand = [&](int s) -> const double * {
+                if (blockOffset[s] >= 0) return storage.data() + blockOffset[s];
+                return dep[s] == DepY ? column(s) + base : column(s);
+            };
+            for (const Instr &in : program) {
+                if (dep[in.dst] != Both) continue;
+                double *r = in.dst == result ? out + i * ny + base : column(in.dst);
+                runKernel(k, in, operand(in.a), in.op == Node::PowInt ? nullptr : operand(in.b), r, n);
+            }
+        }
+    }
+}
+
+void ExpressionParser::runKernel(const VectorMath::Kernels &k, const Instr &in,
+                                 const double *a, const double *b, double *r, int n)
+{
+    switch (in.op) {
+    case Node::Add: k.add(a, b, r, n); break;
+    case Node::Sub: k.sub(a, b, r, n); break;
+    case Node::Mul: k.mul(a, b, r, n); break;
+    case Node::Div: k.div(a, b, r, n); break;
+    case Node::Pow: k.pow(a, b, r, n); break;
+    case Node::PowInt: k.powInt(a, in.b, r, n); break;
+    case Node::Negate: k.negate(a, r, n); break;
+    case Node::Sin: k.sin(a, r, n); break;
+    case Node::Cos: k.cos(a, r, n); break;
+    case Node::Tan: k.tan(a, r, n); break;
+    case Node::Sqrt: k.sqrt(a, r, n); break;
+    case Node::Exp: k.exp(a, r, n); break;
+    case Node::Log: k.log(a, r, n); break;
+    default: std::fill(r, r + n, qQNaN()); break;
+    }
+}
+
+// Lowers the DAG below roots into m_program, one instruction per unique
+// node, and returns the register that holds the value of each root. A
+// temporary goes back on the free list as soon as its last consumer has
+// read it, so the register file stays about as small as the tree is deep;
+// the roots keep theirs to the end. Children always come before their
+// parents in m_nodes, so the passes below are plain sweeps over the
+// indices and long chains such as a sum of thousands of terms cannot
+// overflow the stack.
+QVector<int> ExpressionParser::compile(const QVector<int> &roots)
+{
+    m_program.clear();
+    m_constants.clear();
+    m_registerCount = 2;
+    m_eliminatedNodes = 0;
+    QVector<int> results;
+    if (roots.isEmpty()) return results;
+
+    // Count the parents of every reachable node and, along the way, how
+    // many nodes the expressions would have as plain trees.
+    const int top = *std::max_element(roots.cbegin(), roots.cend());
+    QVector<int> uses(m_nodes.size(), 0);
+    for (int root : roots)
+        ++uses[root];
+    int uniqueNodes = 0;
+    for (int n = top; n >= 0; --n) {
+        if (!uses[n]) continue;
+        ++uniqueNodes;
+        if (m_nodes[n].left >= 0) ++uses[m_nodes[n].left];
+        if (m_nodes[n].right >= 0) ++uses[m_nodes[n].right];
+    }
+    // Shared subexpressions can make the tree exponentially large.
+    const qint64 maxSize = std::numeric_limits<int>::max();
+    QVector<qint64> treeSize(top + 1, 0);
+    for (int n = 0; n <= top; ++n) {
+        if (!uses[n]) continue;
+        const Node &node = m_nodes[n];
+        qint64 size = 1;
+        if (node.left >= 0) size += treeSize[node.left];
+        if (node.right >= 0) size += treeSize[node.right];
+        treeSize[n] = qMin(size, maxSize);
+    }
+    qint64 treeNodes = 0;
+    for (int root : roots)
+        treeNodes = qMin(treeNodes + treeSize[root], maxSize);
+    m_eliminatedNodes = int(treeNodes - uniqueNodes);
+
+    // regOf holds the register of every node compiled so far, 0 for none
+    // yet (register 0 is x, which never needs an entry).
+    QVector<int> regOf(m_nodes.size(), 0);
+    QVector<int> freeRegs;
+    // Variables, constants and nodes that already have a register need no
+    // instruction; ready() stores their register in reg.
+    auto ready = [&](int n, int &reg) {
+        const Node &node = m_nodes[n];
+        if (node.type == Node::Variable || node.type == Node::VariableY) {
+            reg = node.type == Node::Variable ? 0 : 1;
+            return true;
+        }
+        if (!regOf[n] && node.type == Node::Number) {
+            m_constants.append(node.value);
+            regOf[n] = -m_constants.size();
+        }
+        reg = regOf[n];
+        return reg != 0;
+    };
+    auto release = [&](int child, int reg) {
+        if (--uses[child] == 0 && reg >= 2) freeRegs.append(reg);
+    };
+
+    // Post-order walk with an explicit stack. stage counts the operands
+    // already compiled, and value is the register of the last node done.
+    struct Frame { int n; int a; int stage; };
+    QVector<Frame> stack;
+    int value = 0;
+    for (int root : roots) {
+        if (!ready(root, value))
+            stack.append({ root, 0, 0 });
+        while (!stack.isEmpty()) {
+            Frame &f = stack.last();
+            const Node &node = m_nodes[f.n];
+            if (f.stage == 0) {
+                f.stage = 1;
+                if (!ready(node.left, value)) {
+                    stack.append({ node.left, 0, 0 });
+                    continue;
+                }
+            }
+            if (f.stage == 1) {
+                f.a = value;
+                f.stage = 2;
+                if (node.type != Node::PowInt && node.right >= 0 && !ready(node.right, value)) {
+                    stack.append({ node.right, 0, 0 });
+                    continue;
+                }
+            }
+            Instr in;
+            in.op = node.type;
+            in.a = f.a;
+            if (node.type == Node::PowInt)
+                in.b = int(node.value);
+            else
+                in.b = node.right >= 0 ? value : in.a;
+            if (node.right >= 0) release(node.right, in.b);
+            release(node.left, in.a);
+            in.dst = freeRegs.isEmpty() ? m_registerCount++ : freeRegs.takeLast();
+            regOf[f.n] = in.dst;
+            m_program.append(in);
+            value = in.dst;
+            stack.removeLast();
+        }
+        results.append(value);
+    }
+
+    // Constants were numbered -1, -2, ... while the temporaries were still
+    // being counted; move them into the block after the last temporary.
+    m_constantBase = m_registerCount;
+    auto relocate = [this](int r) { return r < 0 ? m_constantBase - r - 1 : r; };
+    for (Instr &in : m_program) {
+        in.a = relocate(in.a);
+        in.b = relocate(in.b);
+    }
+    for (int &r : results)
+        r = relocate(r);
+    m_registerCount += m_constants.size();
+    return results;
+}
+
+double ExpressionParser::run(double *regs) const
+{
+    for (const Instr &in : m_program) {
+        const double a = regs[in.a];
+        double r;
+        switch (in.op) {
+        case Node::Add: r = a + regs[in.b]; break;
+        case Node::Sub: r = a - regs[in.b]; break;
+        case Node::Mul: r = a * regs[in.b]; break;
+        case Node::Div: r = regs[in.b] == 0 ? qQNaN() : a / regs[in.b]; break;
+        case Node::Pow: r = std::pow(a, regs[in.b]); break;
+        case Node::PowInt: r = VectorMath::scalarPowInt(a, in.b); break;
+        case Node::Negate: r = -a; break;
+        case Node::Sin: r = std::sin(a); break;
+        case Node::Cos: r = std::cos(a); break;
+        case Node::Tan: r = std::tan(a); break;
+        case Node::Sqrt: r = safeSqrt(a); break;
+        case Node::Exp: r = std::exp(a); break;
+        case Node::Log: r = safeLog(a); break;
+        default: r = qQNaN(); break;
+        }
+        regs[in.dst] = r;
+    }
+    return regs[m_resultRegister];
+}
+
+// Translates m_program instruction by instruction. m_native stays empty
+// when the platform cannot run generated code, and eval() interprets.
+void ExpressionParser::compileNative()
+{
+    if (m_program.isEmpty() || !NativeCode::isSupported()) return;
+    QSharedPointer<NativeCode> code(new NativeCode(m_registerCount));
+    for (int c = 0; c < m_constants.size(); ++c)
+        code->setConstant(m_constantBase + c, m_constants[c]);
+    // The second operand of a binary step is always read from memory.
+    auto readsSecond = [](const Instr &in, int reg) {
+        const bool binary = in.op == Node::Add || in.op == Node::Sub || in.op == Node::Mul
+            || in.op == Node::Div || in.op == Node::Pow;
+        return binary && in.b == reg;
+    };
+    // A result that only the next instruction reads, as its first operand,
+    // stays in the accumulator instead of going through memory; so does
+    // the final result, which the function returns.
+    auto staysInAccumulator = [&](int i) {
+        if (i + 1 == m_program.size()) return true;
+        const int reg = m_program[i].dst;
+        const Instr &next = m_program[i + 1];
+        if (next.a != reg || readsSecond(next, reg))
+            return false;
+        for (int j = i + 2; j < m_program.size(); ++j) {
+            if (m_program[j].a == reg || readsSecond(m_program[j], reg)) return false;
+            if (m_program[j].dst == reg) return true;
+        }
+        return true;
+    };
+
+    bool inAccumulator = false;
+    for (int i = 0; i < m_program.size(); ++i) {
+        const Instr &in = m_program[i];
+        if (!inAccumulator)
+            code->load(in.a);
+        switch (in.op) {
+        case Node::Add: code->apply(NativeCode::Add, in.b); break;
+        case Node::Sub: code->apply(NativeCode::Sub, in.b); break;
+        case Node::Mul: code->apply(NativeCode::Mul, in.b); break;
+        case Node::Div: code->apply(NativeCode::Div, in.b); break;
+        case Node::Pow: code->call(VectorMath::scalarPow, in.b); break;
+        case Node::PowInt: code->powInt(in.b); break;
+        case Node::Negate: code->negate(); break;
+        case Node::Sin: code->call(VectorMath::scalarSin); break;
+        case Node::Cos: code->call(VectorMath::scalarCos); break;
+        case Node::Tan: code->call(VectorMath::scalarTan); break;
+        case Node::Sqrt: code->sqrt(); break;
+        case Node::Exp: code->call(VectorMath::scalarExp); break;
+        case Node::Log: code->call(VectorMath::scalarLog); break;
+        default: return;
+        }
+        inAccumulator = staysInAccumulator(i);
+        if (!inAccumulator)
+            code->store(in.dst);
+    }
+    if (code->finish())
+        m_native = code;
+}
+
+double ExpressionParser::evalNode(int n, double x, double y) const
+{
+    if (n < 0) return qQNaN();
+    const Node &node = m_nodes[n];
+    switch (node.type) {
+    case Node::Number: return node.value;
     case Node::Variable: return x;
     case Node::VariableY: return y;
-    case Node::Add: return evalNode(n->left, x, y) + evalNode(n->right, x, y);
-    case Node::Sub: return evalNode(n->left, x, y) - evalNode(n->right, x, y);
-    case Node::Mul: return evalNode(n->left, x, y) * evalNode(n->right, x, y);
+    case Node::Add: return evalNode(node.left, x, y) + evalNode(node.right, x, y);
+    case Node::Sub: return evalNode(node.left, x, y) - evalNode(node.right, x, y);
+    case Node::Mul: return evalNode(node.left, x, y) * evalNode(node.right, x, y);
     case Node::Div: {
-        double d = evalNode(n->right, x, y);
-        return d == 0 ? qQNaN() : evalNode(n->left, x, y) / d;
-    }
-    case Node::Pow: return std::pow(evalNode(n->left, x, y), evalNode(n->right, x, y));
-    case Node::Negate: return -evalNode(n->left, x, y);
-    case Node::Sin: return std::sin(evalNode(n->left, x, y));
-    case Node::Cos: return std::cos(evalNode(n->left, x, y));
-    case Node::Tan: return std::tan(evalNode(n->left, x, y));
-    case Node::Sqrt: return safeSqrt(evalNode(n->left, x, y));
-    case Node::Exp: return std::exp(evalNode(n->left, x, y));
-    case Node::Log: return safeLog(evalNode(n->left, x, y));
+        double d = evalNode(node.right, x, y);
+        return d == 0 ? qQNaN() : evalNode(node.left, x, y) / d;
+    }
+    case Node::Pow: return std::pow(evalNode(node.left, x, y), evalNode(node.right, x, y));
+    case Node::Negate: return -evalNode(node.left, x, y);
+    case Node::Sin: return std::sin(evalNode(node.left, x, y));
+    case Node::Cos: return std::cos(evalNode(node.left, x, y));
+    case Node::Tan: return std::tan(evalNode(node.left, x, y));
+    case Node::Sqrt: return safeSqrt(evalNode(node.left, x, y));
+    case Node::Exp: return std::exp(evalNode(node.left, x, y));
+    case Node::Log: return safeLog(evalNode(node.left, x, y));
+    case Node::PowInt: return VectorMath::scalarPowInt(evalNode(node.left, x, y), int(node.value));
     }
     return qQNaN();
 }
 
-ExpressionParser::Node *ExpressionParser::parseExpression()
-{
-    Node *left = parseTerm();
-    if (!left && !m_error.isEmpty()) return nullptr;
-    skipSpaces();
-    while (m_pos < m_input.size()) {
-        QChar c = m_input[m_pos];
-        if (c == QLatin1Char('+')) {
-            ++m_pos;
-            skipSpaces();
-            Node *right = parseTerm();
-            if (!right) { delete left; return nullptr; }
-            Node *n = new Node;
-            n->type = Node::Add;
-            n->left = left;
-            n->right = right;
-            left = n;
-        } else if (c == QLatin1Char('-')) {
-            ++m_pos;
-            skipSpaces();
-            Node *right = parseTerm();
-            if (!right) { delete left; return nullptr; }
-            Node *n = new Node;
-            n->type = Node::Sub;
-            n->left = left;
-            n->right = right;
-            left = n;
-        } else
-            break;
-        skipSpaces();
+namespace {
+typedef ExpressionParser::Interval Interval;
+
+const double Inf = std::numeric_limits<double>::infinity();
+const Interval Empty = { qQNaN(), qQNaN() };
+const Interval Everything = { -Inf, Inf };
+
+// inf - inf and inf / inf turn up at infinite endpoints; an endpoint that
+// came out NaN leaves that side unbounded.
+Interval bounded(double lo, double hi)
+{
+    return { std::isnan(lo) ? -Inf : lo, std::isnan(hi) ? Inf : hi };
+}
+
+Interval bounding(const double *v, int n)
+{
+    double lo = Inf, hi = -Inf;
+    for (int i = 0; i < n; ++i) {
+        if (std::isnan(v[i])) return Everything;
+        lo = qMin(lo, v[i]);
+        hi = qMax(hi, v[i]);
     }
-    return left;
+    return { lo, hi };
 }
 
-ExpressionParser::Node *ExpressionParser::parseTerm()
-{
-    Node *left = parseFactor();
-    if (!left && !m_error.isEmpty()) return nullptr;
-    skipSpaces();
-    while (m_pos < m_input.size()) {
-        QChar c = m_input[m_pos];
-        if (c == QLatin1Char('*')) {
-            ++m_pos;
-            skipSpaces();
-            Node *right = parseFactor();
-            if (!right) { delete left; return nullptr; }
-            Node *n = new Node;
-            n->type = Node::Mul;
-            n->left = left;
-            n->right = right;
-            left = n;
-        } else if (c == QLatin1Char('/')) {
-            ++m_pos;
-            skipSpaces();
-            Node *right = parseFactor();
-            if (!right) { delete left; return nullptr; }
-            Node *n = new Node;
-            n->type = Node::Div;
-            n->left = left;
-            n->right = right;
-            left = n;
-        } else
-            break;
-        skipSpaces();
+// Arithmetic, sqrt and integer powers are rounded monotonically, so the
+// rounded endpoints already bound the rounded results. Library functions
+// are within an ulp of the true value, and the SIMD exp and log within two
+// ulps of them; SlackUlps covers both on either side.
+const int SlackUlps = 4;
+// The SIMD sin and cos reduce their argument by multiples of pi/4 in
+// doubles, which leaves an absolute error of up to 2^-52: near their zeros
+// that is millions of ulps of the result, so they get SineSlack on top.
+const double SineSlack = 4 * std::numeric_limits<double>::epsilon();
+
+Interval widened(Interval r, double slack = 0)
+{
+    for (int i = 0; i < SlackUlps; ++i) {
+        r.lo = std::nextafter(r.lo, -Inf);
+        r.hi = std::nextafter(r.hi, Inf);
     }
-    return left;
+    return { r.lo - slack, r.hi + slack };
 }
 
-ExpressionParser::Node *ExpressionParser::parseFactor()
+Interval negated(Interval a)
 {
-    return parsePower();
+    return { -a.hi, -a.lo };
+}
+
+Interval sum(Interval a, Interval b)
+{
+    return bounded(a.lo + b.lo, a.hi + b.hi);
+}
+
+// 0 * inf only comes from a value that is really a finite number times
+// one that overflowed, so the corner counts as 0.
+Interval product(Interval a, Interval b)
+{
+    auto mul = [](double u, double v) { return u == 0 || v == 0 ? 0.0 : u * v; };
+    const double corners[] = { mul(a.lo, b.lo), mul(a.lo, b.hi), mul(a.hi, b.lo), mul(a.hi, b.hi) };
+    return bounding(corners, 4);
 }
 
-ExpressionParser::Node *ExpressionParser::parsePower()
-{
-    Node *base = parseUnary();
-    if (!base && !m_error.isEmpty()) return nullptr;
-    skipSpaces();
-    if (m_pos < m_input.size() && m_input[m_pos] == QLatin1Char('^')) {
-        ++m_pos;
-        skipSpaces();
-        Node *exp = parsePower();
-        if (!exp) { delete base; return nullptr; }
-        Node *n = new Node;
-        n->type = Node::Pow;
-        n->left = base;
-        n->right = exp;
-        return n;
-    }
-    // Implicit multiplication: 2x, xy, x(1+2), etc.
-    if (m_pos < m_input.size()) {
-        QChar c = m_input[m_pos];
-        bool implicit = c == QLatin1Char('x') || c == QLatin1Char('X')
-            || c == QLatin1Char('y') || c == QLatin1Char('Y') || c == QLatin1Char('(')
-            || c.isDigit() || c == QLatin1Char('.');
-        if (!implicit && (c == 's' || c == 'c' || c == 't' || c == 'e' || c == 'l')) {
-            QString rest = m_input.mid(m_pos);
-            implicit = rest.startsWith(QLatin1String("sin"), Qt::CaseInsensitive)
-                || rest.startsWith(QLatin1String("cos"), Qt::CaseInsensitive)
-                || rest.startsWith(QLatin1String("tan"), Qt::CaseInsensitive)
-                || rest.startsWith(QLatin1String("sqrt"), Qt::CaseInsensitive)
-                || rest.startsWith(QLatin1String("exp"), Qt::CaseInsensitive)
-                || rest.startsWith(QLatin1String("log"), Qt::CaseInsensitive);
+// Division by an exact zero is NaN, as in eval(), so a divisor that only
+// touches zero at one end leaves the quotient unbounded on one side.
+Interval quotient(Interval a, Interval b)
+{
+    if (b.lo > 0 || b.hi < 0) {
+        const double corners[] = { a.lo / b.lo, a.lo / b.hi, a.hi / b.lo, a.hi / b.hi };
+        return bounding(corners, 4);
+    }
+    if (b.lo == 0 && b.hi == 0) return Empty;
+    if (a.lo == 0 && a.hi == 0) return { 0, 0 };
+    if (b.lo < 0 && b.hi > 0) return Everything;
+    if (b.hi == 0) return negated(quotient(a, negated(b)));
+    if (a.lo >= 0) return bounded(a.lo / b.hi, Inf);
+    if (a.hi <= 0) return bounded(-Inf, a.hi / b.hi);
+    return Everything;
+}
+
+// pow is monotonic in each argument over non-negative bases, so the
+// corners bound it there. Negative bases only give numbers for integer
+// exponents, or at -0 and -inf; a single integer exponent keeps the bound
+// tight, a range of them is bounded by magnitude. pow(1, NaN) and
+// pow(NaN, 0) are 1.
+Interval power(Interval a, Interval b)
+{
+    double lo = Inf, hi = -Inf;
+    auto include = [&](double v) {
+        if (std::isnan(v)) return;
+        lo = qMin(lo, v);
+        hi = qMax(hi, v);
+    };
+    if (b.contains(0) || a.contains(1))
+        include(1);
+    if (a.isEmpty() || b.isEmpty())
+        return lo <= hi ? Interval{ lo, hi } : Empty;
+
+    if (a.hi >= 0) {
+        const double bottom = a.lo > 0 ? a.lo : 0.0, top = a.hi > 0 ? a.hi : 0.0;
+        for (double x : { bottom, top })
+            for (double y : { b.lo, b.hi })
+                include(std::pow(x, y));
+    }
+    // A range that reaches 0 may hold -0, and pow(-0, -1) is -inf.
+    if (a.lo <= 0) {
+        const double top = a.hi < 0 ? a.hi : -0.0;
+        const double first = std::ceil(b.lo), last = std::floor(b.hi);
+        for (double x : { a.lo, top })
+            for (double y : { b.lo, b.hi })
+                include(std::pow(x, y));
+        if (first == last) {
+            include(std::pow(a.lo, first));
+            include(std::pow(top, first));
+        } else if (first < last) {
+            double m = 0;
+            for (double x : { a.lo, top })
+                for (double y : { first, last })
+                    m = qMax(m, std::fabs(std::pow(x, y)));
+            include(-m);
+            include(m);
         }
-        if (implicit) {
-            Node *right = parseUnary();
-            if (right) {
-                Node *n = new Node;
-                n->type = Node::Mul;
-                n->left = base;
-                n->right = right;
-                return n;
+    }
+    return lo <= hi ? widened({ lo, hi }) : Empty;
+}
+
+Interval intPower(Interval a, int n)
+{
+    if (n == 0) return { 1, 1 };
+    const double l = VectorMath::scalarPowInt(a.lo, n), h = VectorMath::scalarPowInt(a.hi, n);
+    if (n % 2 || a.lo >= 0) return { l, h };
+    if (a.hi <= 0) return { h, l };
+    return { 0, qMax(l, h) };
+}
+
+// True when phase + k * period lies in [lo, hi] for some integer k. Errs
+// towards true, which only loosens the bound.
+bool reaches(Interval a, double phase, double period)
+{
+    const double k = std::ceil((a.lo - phase) / period - 1e-9);
+    return phase + k * period <= a.hi + 1e-9 * period;
+}
+
+// Beyond this, multiples of pi are too coarse to place the extrema.
+const double PeriodicLimit = 1e6;
+
+Interval sine(Interval a, double (*f)(double), double peak, double trough)
+{
+    if (!(a.hi - a.lo < 2 * M_PI) || -a.lo > PeriodicLimit || a.hi > PeriodicLimit)
+        return widened({ -1, 1 }, SineSlack);
+    const double l = f(a.lo), h = f(a.hi);
+    return widened({ reaches(a, trough, 2 * M_PI) ? -1 : qMin(l, h),
+                     reaches(a, peak, 2 * M_PI) ? 1 : qMax(l, h) }, SineSlack);
+}
+
+Interval tangent(Interval a)
+{
+    if (!(a.hi - a.lo < M_PI) || -a.lo > PeriodicLimit || a.hi > PeriodicLimit
+        || reaches(a, M_PI / 2, M_PI))
+        return Everything;
+    return widened({ std::tan(a.lo), std::tan(a.hi) });
+}
+} // namespace
+
+ExpressionParser::Interval ExpressionParser::evalInterval(double xLo, double xHi) const
+{
+    return evalInterval(xLo, xHi, 0, 0);
+}
+
+// Runs the compiled program on intervals instead of numbers, so shared
+// subexpressions are bounded once.
+ExpressionParser::Interval ExpressionParser::evalInterval(double xLo, double xHi, double yLo, double yHi) const
+{
+    if (m_root < 0) return Empty;
+    QVarLengthArray<Interval, 64> regs(m_registerCount);
+    regs[0] = { qMin(xLo, xHi), qMax(xLo, xHi) };
+    regs[1] = { qMin(yLo, yHi), qMax(yLo, yHi) };
+    for (int c = 0; c < m_constants.size(); ++c)
+        regs[m_constantBase + c] = { m_constants[c], m_constants[c] };
+
+    for (const Instr &in : m_program) {
+        const Interval a = regs[in.a];
+        const Interval b = in.op == Node::PowInt ? a : regs[in.b];
+        Interval r = Empty;
+        if (in.op == Node::Pow)
+            r = power(a, b);
+        else if (in.op == Node::PowInt && in.b == 0)
+            r = { 1, 1 };
+        else if (!a.isEmpty() && !b.isEmpty()) {
+            switch (in.op) {
+            case Node::Add: r = sum(a, b); break;
+            case Node::Sub: r = sum(a, negated(b)); break;
+            case Node::Mul: r = product(a, b); break;
+            case Node::Div: r = quotient(a, b); break;
+            case Node::PowInt: r = intPower(a, in.b); break;
+            case Node::Negate: r = negated(a); break;
+            case Node::Sin: r = sine(a, std::sin, M_PI / 2, -M_PI / 2); break;
+            case Node::Cos: r = sine(a, std::cos, 0, M_PI); break;
+            case Node::Tan: r = tangent(a); break;
+            case Node::Sqrt:
+                if (a.hi >= 0) r = { std::sqrt(qMax(a.lo, 0.0)), std::sqrt(a.hi) };
+                break;
+            case Node::Exp: r = widened({ std::exp(a.lo), std::exp(a.hi) }); break;
+            case Node::Log:
+                if (a.hi > 0) r = widened({ a.lo > 0 ? std::log(a.lo) : -Inf, std::log(a.hi) });
+                break;
+            default: break;
             }
         }
+        regs[in.dst] = r;
     }
-    return base;
+    return regs[m_resultRegister];
 }
 
-ExpressionParser::Node *ExpressionParser::parseUnary()
+// Rewrites every node bottom-up and returns the node that replaces root.
+// Children come before their parents in m_nodes, so a single sweep over
+// the indices sees every child rewritten before its parent.
+int ExpressionParser::optimize(int root)
 {
-    skipSpaces();
-    if (m_pos < m_input.size() && m_input[m_pos] == QLatin1Char('-')) {
-        ++m_pos;
-        Node *child = parseUnary();
-        if (!child) return nullptr;
-        Node *n = new Node;
-        n->type = Node::Negate;
-        n->left = child;
-        return n;
+    QVector<int> rewritten(root + 1);
+    for (int n = 0; n <= root; ++n) {
+        const Node &node = m_nodes[n];
+        if (node.left < 0) {
+            rewritten[n] = n;
+            continue;
+        }
+        const int l = rewritten[node.left];
+        const int r = node.right >= 0 ? rewritten[node.right] : -1;
+        rewritten[n] = simplify(n, l, r);
     }
-    return parsePrimary();
+    return rewritten[root];
 }
 
-ExpressionParser::Node *ExpressionParser::parseFunction(const QString &name)
+// Returns the node that replaces n once its children have been rewritten
+// to l and r. Nodes are shared, so nothing is changed in place; rewrites go
+// through makeNode and stay hash-consed. Every rewrite gives the same value
+// as evalNode on the original for NaN, infinite and finite operands alike,
+// with two exceptions: dropping an added or subtracted zero may flip the
+// sign of a zero result, and integer powers may differ from std::pow in the
+// last bits.
+int ExpressionParser::simplify(int n, int l, int r)
 {
-    skipSpaces();
-    if (m_pos >= m_input.size() || m_input[m_pos] != QLatin1Char('(')) {
-        m_error = QStringLiteral("Expected '(' after '%1'").arg(name);
-        return nullptr;
+    // Copied, since makeNode may reallocate m_nodes.
+    const Node node = m_nodes[n];
+
+    auto isNumber = [this](int c, double v) {
+        return c >= 0 && m_nodes[c].type == Node::Number && m_nodes[c].value == v;
+    };
+    auto number = [this](double v) { return makeNode(Node::Number, -1, -1, v); };
+    auto child = [this](int c) { return m_nodes[c].left; };
+
+    const bool leftConst = m_nodes[l].type == Node::Number;
+    const bool rightConst = r >= 0 && m_nodes[r].type == Node::Number;
+    const double rightValue = rightConst ? m_nodes[r].value : 0;
+    if (leftConst && (rightConst || r < 0))
+        return number(evalNode(makeNode(node.type, l, r, node.value), 0, 0));
+    // NaN swallows every arithmetic operation. Pow is left alone because
+    // pow(1, NaN) and pow(NaN, 0) are both 1.
+    const bool arithmetic = node.type == Node::Add || node.type == Node::Sub
+        || node.type == Node::Mul || node.type == Node::Div;
+    if (arithmetic && ((leftConst && std::isnan(m_nodes[l].value)) || (rightConst && std::isnan(rightValue))))
+        return number(qQNaN());
+
+    const bool rightNegate = r >= 0 && m_nodes[r].type == Node::Negate;
+    switch (node.type) {
+    case Node::Add:
+        if (isNumber(r, 0)) return l;
+        if (isNumber(l, 0)) return r;
+        if (rightNegate) return makeNode(Node::Sub, l, child(r));
+        break;
+    case Node::Sub:
+        if (isNumber(r, 0)) return l;
+        if (isNumber(l, 0)) return rightNegate ? child(r) : makeNode(Node::Negate, r);
+        if (rightNegate) return makeNode(Node::Add, l, child(r));
+        break;
+    case Node::Mul:
+        if (isNumber(r, 1)) return l;
+        if (isNumber(l, 1)) return r;
+        break;
+    case Node::Div:
+        if (!rightConst) break;
+        if (rightValue == 0) return number(qQNaN());
+        if (rightValue == 1) return l;
+        {
+            // Dividing by a power of two is the same as multiplying by its
+            // reciprocal as long as that reciprocal is a normal number.
+            int exp = 0;
+            const double inv = 1 / rightValue;
+            if (std::abs(std::frexp(rightValue, &exp)) == 0.5 && std::isnormal(inv))
+                return makeNode(Node::Mul, l, number(inv));
+        }
+        break;
+    case Node::Pow:
+        if (!rightConst) break;
+        if (rightValue == 0) return number(1);
+        if (rightValue == 1) return l;
+        if (rightValue > 0 && rightValue <= MaxPowIntExponent && rightValue == std::floor(rightValue))
+            return makeNode(Node::PowInt, l, -1, rightValue);
+        break;
+    case Node::Negate:
+        if (m_nodes[l].type == Node::Negate) return child(l);
+        break;
+    default:
+        break;
     }
-    ++m_pos;
-    Node *arg = parseExpression();
-    if (!arg) return nullptr;
-    skipSpaces();
-    if (m_pos >= m_input.size() || m_input[m_pos] != QLatin1Char(')')) {
-        delete arg;
-        m_error = QStringLiteral("Expected ')'");
-        return nullptr;
+    return l == node.left && r == node.right ? n : makeNode(node.type, l, r, node.value);
+}
+
+// Prints without recursion and into a single string, so deeply nested
+// expressions print in linear time.
+QString ExpressionParser::toString() const
+{
+    if (m_root < 0) return QString();
+
+    auto precedence = [this](int c) {
+        switch (m_nodes[c].type) {
+        case Node::Add: case Node::Sub: return 1;
+        case Node::Mul: case Node::Div: return 2;
+        case Node::Negate: return 3;
+        case Node::Pow: case Node::PowInt: return 4;
+        case Node::Number: return m_nodes[c].value < 0 ? 3 : 5;
+        default: return 5;
+        }
+    };
+    // What remains to be written, the next piece last. An operand is a
+    // node, in parentheses when it binds less tightly than minPrecedence;
+    // an exponent is the power of a PowInt node.
+    struct Piece {
+        enum Kind { Text, Operand, Exponent } kind;
+        int node;
+        int minPrecedence;
+        const char *text;
+    };
+    auto text = [](const char *s) { return Piece{ Piece::Text, -1, 0, s }; };
+    auto operand = [](int c, int minPrecedence) { return Piece{ Piece::Operand, c, minPrecedence, nullptr }; };
+    QVector<Piece> pieces;
+    pieces.append(operand(m_root, 0));
+    QString out;
+    while (!pieces.isEmpty()) {
+        const Piece piece = pieces.takeLast();
+        if (piece.kind == Piece::Text) {
+            out += QLatin1String(piece.text);
+            continue;
+        }
+        const int n = piece.node;
+        const Node &node = m_nodes[n];
+        if (piece.kind == Piece::Exponent) {
+            out += QLatin1Char('^') + QString::number(int(node.value));
+            continue;
+        }
+        const int p = precedence(n);
+        if (p < piece.minPrecedence) {
+            pieces.append(text(")"));
+            pieces.append(operand(n, 0));
+            out += QLatin1Char('(');
+            continue;
+        }
+        // Pushed in reverse, right operand first.
+        auto binary = [&](int leftMin, const char *op, int rightMin) {
+            pieces.append(operand(node.right, rightMin));
+            pieces.append(text(op));
+            pieces.append(operand(node.left, leftMin));
+        };
+        auto call = [&](const char *name) {
+            pieces.append(text(")"));
+            pieces.append(operand(node.left, 0));
+            out += QLatin1String(name);
+            out += QLatin1Char('(');
+        };
+        switch (node.type) {
+        case Node::Number: out += QString::number(node.value, 'g', 17); break;
+        case Node::Variable: out += QLatin1Char('x'); break;
+        case Node::VariableY: out += QLatin1Char('y'); break;
+        case Node::Add: binary(p, " + ", p); break;
+        case Node::Sub: binary(p, " - ", p + 1); break;
+        case Node::Mul: binary(p, "*", p); break;
+        case Node::Div: binary(p, "/", p + 1); break;
+        case Node::Pow: binary(p + 1, "^", p); break;
+        case Node::PowInt:
+            pieces.append(Piece{ Piece::Exponent, n, 0, nullptr });
+            pieces.append(operand(node.left, p + 1));
+            break;
+        case Node::Negate:
+            pieces.append(operand(node.left, p));
+            out += QLatin1Char('-');
+            break;
+        case Node::Sin: call("sin"); break;
+        case Node::Cos: call("cos"); break;
+        case Node::Tan: call("tan"); break;
+        case Node::Sqrt: call("sqrt"); break;
+        case Node::Exp: call("exp"); break;
+        case Node::Log: call("log"); break;
+        }
     }
-    ++m_pos;
+    return out;
+}
 
-    Node *n = new Node;
-    n->left = arg;
-    if (name == QLatin1String("sin")) n->type = Node::Sin;
-    else if (name == QLatin1String("cos")) n->type = Node::Cos;
-    else if (name == QLatin1String("tan")) n->type = Node::Tan;
-    else if (name == QLatin1String("sqrt")) n->type = Node::Sqrt;
-    else if (name == QLatin1String("exp")) n->type = Node::Exp;
-    else if (name == QLatin1String("log")) n->type = Node::Log;
-    else { m_error = QStringLiteral("Unknown function: %1").arg(name); delete n; return nullptr; }
-    return n;
+int ExpressionParser::parseExpression()
+{
+    int left = parseTerm();
+    if (left < 0) return -1;
+    while (true) {
+        const Token::Kind kind = m_tokens[m_token].kind;
+        if (kind != Token::Plus && kind != Token::Minus)
+            break;
+        ++m_token;
+        int right = parseTerm();
+        if (right < 0) return -1;
+        left = makeNode(kind == Token::Plus ? Node::Add : Node::Sub, left, right);
+    }
+    return left;
 }
 
-ExpressionParser::Node *ExpressionParser::parsePrimary()
+int ExpressionParser::parseTerm()
 {
-    skipSpaces();
-    if (m_pos >= m_input.size()) {
-        m_error = QStringLiteral("Unexpected end of expression");
-        return nullptr;
+    int left = parseFactor();
+    if (left < 0) return -1;
+    while (true) {
+        const Token::Kind kind = m_tokens[m_token].kind;
+        if (kind != Token::Star && kind != Token::Slash)
+            break;
+        ++m_token;
+        int right = parseFactor();
+        if (right < 0) return -1;
+        left = makeNode(kind == Token::Star ? Node::Mul : Node::Div, left, right);
+    }
+    return left;
+}
+
+int ExpressionParser::parseFactor()
+{
+    return parsePower();
+}
+
+int ExpressionParser::parsePower()
+{
+    const Nesting nesting(m_depth);
+    if (m_depth > MaxNesting) return tooDeep();
+    int base = parseUnary();
+    if (base < 0) return -1;
+    const Token &t = m_tokens[m_token];
+    if (t.kind == Token::Caret) {
+        ++m_token;
+        int exp = parsePower();
+        if (exp < 0) return -1;
+        return makeNode(Node::Pow, base, exp);
+    }
+    // Implicit multiplication: 2x, xy, x(1+2), etc. A function only counts
+    // when spelled in lower case or in LaTeX.
+    bool implicit = false;
+    switch (t.kind) {
+    case Token::X: case Token::Y: case Token::LeftParen: case Token::Number: case Token::BadNumber:
+        implicit = true;
+        break;
+    case Token::Function: {
+        const QChar c = m_input[t.pos];
+        implicit = c == QLatin1Char('\\') || c == QLatin1Char('s') || c == QLatin1Char('c')
+            || c == QLatin1Char('t') || c == QLatin1Char('e') || c == QLatin1Char('l');
+        break;
+    }
+    case Token::Invalid:
+        implicit = m_input[t.pos] == QLatin1Char('.');
+        break;
+    default:
+        break;
     }
+    if (implicit) {
+        int right = parseUnary();
+        if (right >= 0)
+            return makeNode(Node::Mul, base, right);
+    }
+    return base;
+}
 
-    if (m_input[m_pos] == QLatin1Char('x') || m_input[m_pos] == QLatin1Char('X')) {
-        Node *n = new Node;
-        n->type = Node::Variable;
-        ++m_pos;
-        return n;
+int ExpressionParser::parseUnary()
+{
+    const Nesting nesting(m_depth);
+    if (m_depth > MaxNesting) return tooDeep();
+    if (m_tokens[m_token].kind == Token::Minus) {
+        ++m_token;
+        int child = parseUnary();
+        if (child < 0) return -1;
+        return makeNode(Node::Negate, child);
     }
+    return parsePrimary();
+}
 
-    if (m_input[m_pos] == QLatin1Char('y') || m_input[m_pos] == QLatin1Char('Y')) {
-        Node *n = new Node;
-        n->type = Node::VariableY;
-        ++m_pos;
-        return n;
+int ExpressionParser::tooDeep()
+{
+    m_error = QStringLiteral("Expression is nested too deeply");
+    return -1;
+}
+
+int ExpressionParser::parseFunction(const Token &function)
+{
+    if (m_tokens[m_token].kind != Token::LeftParen) {
+        m_error = QStringLiteral("Expected '(' after '%1'").arg(QLatin1String(function.name));
+        return -1;
+    }
+    ++m_token;
+    int arg = parseExpression();
+    if (arg < 0) return -1;
+    if (m_tokens[m_token].kind != Token::RightParen) {
+        m_error = QStringLiteral("Expected ')'");
+        return -1;
     }
+    ++m_token;
+    return makeNode(function.function, arg);
+}
 
-    if (m_input[m_pos] == QLatin1Char('(')) {
-        ++m_pos;
-        Node *inner = parseExpression();
-        if (!inner) return nullptr;
-        skipSpaces();
-        if (m_pos >= m_input.size() || m_input[m_pos] != QLatin1Char(')')) {
-            delete inner;
+int ExpressionParser::parsePrimary()
+{
+    const Token &t = m_tokens[m_token];
+    switch (t.kind) {
+    case Token::End:
+        m_error = QStringLiteral("Unexpected end of expression");
+        return -1;
+    case Token::X:
+        ++m_token;
+        return makeNode(Node::Variable);
+    case Token::Y:
+        ++m_token;
+        return makeNode(Node::VariableY);
+    case Token::LeftParen: {
+        ++m_token;
+        int inner = parseExpression();
+        if (inner < 0) return -1;
+        if (m_tokens[m_token].kind != Token::RightParen) {
             m_error = QStringLiteral("Expected ')'");
-            return nullptr;
+            return -1;
         }
-        ++m_pos;
+        ++m_token;
         return inner;
     }
-
-    if (m_input[m_pos].isDigit() || (m_input[m_pos] == QLatin1Char('.') && m_pos + 1 < m_input.size() && m_input[m_pos + 1].isDigit())) {
-        int start = m_pos;
-        if (m_input[m_pos] == QLatin1Char('.')) ++m_pos;
-        while (m_pos < m_input.size() && (m_input[m_pos].isDigit() || m_input[m_pos] == QLatin1Char('.')))
-            ++m_pos;
-        bool ok = false;
-        double v = m_input.mid(start, m_pos - start).toDouble(&ok);
-        if (!ok) { m_error = QStringLiteral("Invalid number"); return nullptr; }
-        Node *n = new Node;
-        n->type = Node::Number;
-        n->value = v;
-        return n;
-    }
-
-    static const char *funcs[] = { "sin", "cos", "tan", "sqrt", "exp", "log" };
-    for (const char *f : funcs) {
-        QString fn = QString::fromLatin1(f);
-        if (m_pos + fn.size() <= m_input.size() && m_input.mid(m_pos, fn.size()).compare(fn, Qt::CaseInsensitive) == 0) {
-            m_pos += fn.size();
-            return parseFunction(fn);
-        }
+    case Token::Number:
+        ++m_token;
+        return makeNode(Node::Number, -1, -1, t.value);
+    case Token::BadNumber:
+        ++m_token;
+        m_error = QStringLiteral("Invalid number");
+        return -1;
+    case Token::Function:
+        ++m_token;
+        return parseFunction(t);
+    default:
+        m_error = QStringLiteral("Unexpected character '%1'").arg(m_input[t.pos]);
+        return -1;
     }
-
-    m_error = QStringLiteral("Unexpected character '%1'").arg(m_input[m_pos]);
-    return nullptr;
 }
@@ -1,45 +1,181 @@
 #ifndef EXPRESSIONPARSER_H
 #define EXPRESSIONPARSER_H
 
+#include <QHash>
+#include <QSharedPointer>
 #include <QString>
 #include <QVector>
 
+class NativeCode;
+namespace VectorMath { struct Kernels; }
+
 class ExpressionParser
 {
 public:
+    // Copies and moves are cheap: the nodes and the compiled program live
+    // in implicitly shared containers.
     ExpressionParser() = default;
 
+    // A closed range [lo, hi]. Empty, with lo and hi NaN, when the
+    // expression is undefined everywhere it was asked about.
+    struct Interval {
+        double lo;
+        double hi;
+        bool isEmpty() const { return !(lo <= hi); }
+        bool contains(double v) const { return lo <= v && v <= hi; }
+    };
+
+    // A value with its partial derivatives by x and y.
+    struct Gradient {
+        double value;
+        double dx;
+        double dy;
+    };
+
+    // Takes time linear in the length of expr. Parentheses, signs and
+    // powers nested some hundreds of levels deep are an error.
     bool parse(const QString &expr);
     double eval(double x) const;
     double eval(double x, double y) const;
+    // f, df/dx and df/dy in a single pass with dual numbers. value is what
+    // eval() returns; where it is NaN, so are the derivatives. A vertical
+    // tangent, as for sqrt(x) at 0, gives an infinite derivative.
+    Gradient evalGradient(double x) const;
+    Gradient evalGradient(double x, double y) const;
+    // Evaluates count points in one call, column by column with the SIMD
+    // kernels from vectormath.h. Without ys, y is 0 as in eval(double).
+    void evalBatch(const double *xs, double *out, int count) const;
+    void evalBatch(const double *xs, const double *ys, double *out, int count) const;
+    // Evaluates the nx by ny grid out[i * ny + j] = f(xs[i], ys[j]). Parts
+    // of the expression that depend on x alone are computed once per row,
+    // parts that depend on y alone once per column, and only the rest once
+    // per cell, so sin(x)*cos(y) costs O(nx + ny) transcendental calls.
+    void evalGrid(const double *xs, int nx, const double *ys, int ny, double *out) const;
+    // Bounds every value the functions above can return for x in [xLo, xHi]
+    // and y in [yLo, yHi], NaN results aside. The bound is guaranteed but
+    // not always tight: x-x gives [xLo-xHi, xHi-xLo], and anything that
+    // divides by an interval containing zero is unbounded.
+    Interval evalInterval(double xLo, double xHi) const;
+    Interval evalInterval(double xLo, double xHi, double yLo, double yHi) const;
     QString errorString() const { return m_error; }
     bool isValid() const { return m_parsed; }
 
+    // When enabled (the default), parse() folds constants, drops identities
+    // such as x*1 and turns small integer powers into multiply chains.
+    void setOptimizationEnabled(bool on) { m_optimize = on; }
+    bool optimizationEnabled() const { return m_optimize; }
+    // When enabled (the default), parse() also turns the program into x86-64
+    // machine code that eval() calls, where the platform allows it.
+    void setNativeCodeEnabled(bool on) { m_nativeEnabled = on; }
+    bool nativeCodeEnabled() const { return m_nativeEnabled; }
+    bool hasNativeCode() const { return !m_native.isNull(); }
+    // The parsed expression in infix form, after optimization if enabled.
+    // Constants that folded to NaN or infinity print as "nan" and "inf".
+    QString toString() const;
+    // How many nodes of the expression tree were merged into an identical
+    // subexpression, e.g. 6 for the second sqrt(x^2+y^2) in
+    // sin(sqrt(x^2+y^2))/sqrt(x^2+y^2).
+    int eliminatedNodes() const { return m_eliminatedNodes; }
+
 private:
+    friend class ExpressionSet;
+
+    // Nodes live side by side in m_nodes and refer to their children by
+    // index, -1 for none. They are hash-consed: makeNode() hands out the
+    // existing node for a repeated subexpression, so the parsed expression
+    // is a DAG and a node may have several parents.
     struct Node {
         enum Type { Number, Variable, VariableY, Add, Sub, Mul, Div, Pow, Negate,
-                    Sin, Cos, Tan, Sqrt, Exp, Log } type;
+                    Sin, Cos, Tan, Sqrt, Exp, Log,
+                    PowInt // left ^ value, value a small non-negative integer
+                  } type;
         double value = 0;
-        Node *left = nullptr;
-        Node *right = nullptr;
-        ~Node();
+        int left = -1;
+        int right = -1;
     };
 
-    void skipSpaces();
-    Node *parseExpression();
-    Node *parseTerm();
-    Node *parseFactor();
-    Node *parsePower();
-    Node *parseUnary();
-    Node *parsePrimary();
-    Node *parseFunction(const QString &name);
-    double evalNode(const Node *n, double x, double y) const;
+    struct NodeKey {
+        Node::Type type;
+        quint64 valueBits; // bitwise, so that 0 and -0 stay apart
+        int left;
+        int right;
+        bool operator==(const NodeKey &o) const
+        {
+            return type == o.type && valueBits == o.valueBits && left == o.left && right == o.right;
+        }
+        friend size_t qHash(const NodeKey &k, size_t seed = 0)
+        {
+            return qHashMulti(seed, int(k.type), k.valueBits, k.left, k.right);
+        }
+    };
+
+    // One step of the compiled program: regs[dst] = op(regs[a], regs[b]).
+    // Register 0 holds x, register 1 holds y, followed by the temporaries
+    // and then the constants of the expression. For PowInt, b is the
+    // exponent itself rather than a register.
+    struct Instr {
+        Node::Type op;
+        int dst;
+        int a;
+        int b;
+    };
+
+    // One lexeme of the input. Function tokens carry the node type and
+    // canonical name of the function, Number tokens their value.
+    struct Token {
+        enum Kind { End, Number, BadNumber, X, Y, Function, Plus, Minus, Star, Slash, Caret,
+                    LeftParen, RightParen, Invalid } kind;
+        int pos; // offset in m_input
+        double value;
+        Node::Type function;
+        const char *name;
+    };
+
+    static constexpr int BatchBlock = 256;
+    // Larger, since every block of the grid also refills the broadcast
+    // copies of its row-invariant values.
+    static constexpr int GridBlock = 1024;
+
+    void tokenize();
+    // The parse functions return a node index, or -1 after an error.
+    int parseExpression();
+    int parseTerm();
+    int parseFactor();
+    int parsePower();
+    int parseUnary();
+    int parsePrimary();
+    int parseFunction(const Token &function);
+    int tooDeep();
+    int makeNode(Node::Type type, int left = -1, int right = -1, double value = 0);
+    void clearNodes();
+    double evalNode(int n, double x, double y) const;
+    int optimize(int root);
+    int simplify(int n, int l, int r);
+    QVector<int> compile(const QVector<int> &roots);
+    double run(double *regs) const;
+    void compileNative();
+    static void runKernel(const VectorMath::Kernels &k, const Instr &in,
+                          const double *a, const double *b, double *r, int n);
 
     QString m_input;
-    int m_pos = 0;
+    QVector<Token> m_tokens; // only filled while parsing
+    int m_token = 0;
+    int m_depth = 0;
     QString m_error;
     bool m_parsed = false;
-    Node *m_root = nullptr;
+    bool m_optimize = true;
+    bool m_nativeEnabled = true;
+    int m_root = -1;
+    QVector<Node> m_nodes;
+    QHash<NodeKey, int> m_nodeIndex; // only filled while parsing
+    int m_eliminatedNodes = 0;
+
+    QVector<Instr> m_program;
+    QVector<double> m_constants;
+    int m_registerCount = 0;
+    int m_constantBase = 0;
+    int m_resultRegister = 0;
+    QSharedPointer<NativeCode> m_native; // shared by copies; the code is read-only
 };
 
 #endif // EXPRESSIONPARSER_H
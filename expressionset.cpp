@@ -0,0 +1,81 @@
+#include "expressionset.h"
+#include "vectormath.h"
+#include <QtGlobal>
+#include <QtMath>
+#include <QVarLengthArray>
+#include <algorithm>
+
+// Copies the nodes parser reaches into m_merged, children first, through
+// makeNode(), which hands out the existing node for any subexpression
+// already there. The program is compiled again for all the roots.
+void ExpressionSet::add(const ExpressionParser &parser)
+{
+    int root = -1;
+    if (parser.isValid() && parser.m_root >= 0) {
+        const QVector<ExpressionParser::Node> &nodes = parser.m_nodes;
+        QVector<bool> reached(parser.m_root + 1, false);
+        reached[parser.m_root] = true;
+        for (int n = parser.m_root; n >= 0; --n) {
+            if (!reached[n]) continue;
+            if (nodes[n].left >= 0) reached[nodes[n].left] = true;
+            if (nodes[n].right >= 0) reached[nodes[n].right] = true;
+        }
+        QVector<int> merged(parser.m_root + 1, -1);
+        for (int n = 0; n <= parser.m_root; ++n) {
+            if (!reached[n]) continue;
+            const ExpressionParser::Node &node = nodes[n];
+            merged[n] = m_merged.makeNode(node.type, node.left >= 0 ? merged[node.left] : -1,
+                                          node.right >= 0 ? merged[node.right] : -1, node.value);
+        }
+        root = merged[parser.m_root];
+    }
+    m_roots.append(root);
+
+    QVector<int> roots;
+    for (int r : m_roots) {
+        if (r >= 0) roots.append(r);
+    }
+    const QVector<int> registers = m_merged.compile(roots);
+    m_results.clear();
+    int next = 0;
+    for (int r : m_roots)
+        m_results.append(r >= 0 ? registers[next++] : -1);
+}
+
+void ExpressionSet::evalBatch(const double *xs, double *const *out, int count) const
+{
+    evalBatch(xs, nullptr, out, count);
+}
+
+// The same column-by-column pass as ExpressionParser::evalBatch(), with
+// the column of every result copied out at the end of each block.
+void ExpressionSet::evalBatch(const double *xs, const double *ys, double *const *out, int count) const
+{
+    if (count <= 0) return;
+    const ExpressionParser &p = m_merged;
+    const int block = qMin(count, int(ExpressionParser::BatchBlock));
+    QVector<double> storage((p.m_registerCount - 1) * block);
+    double *zeros = storage.data();
+    QVarLengthArray<double *, 64> cols(p.m_registerCount);
+    for (int r = 2; r < p.m_registerCount; ++r)
+        cols[r] = storage.data() + (r - 1) * block;
+    for (int c = 0; c < p.m_constants.size(); ++c)
+        std::fill(cols[p.m_constantBase + c], cols[p.m_constantBase + c] + block, p.m_constants[c]);
+
+    const VectorMath::Kernels &k = VectorMath::kernels();
+    for (int base = 0; base < count; base += block) {
+        const int n = qMin(block, count - base);
+        cols[0] = const_cast<double *>(xs + base);
+        cols[1] = ys ? const_cast<double *>(ys + base) : zeros;
+        for (const ExpressionParser::Instr &in : p.m_program) {
+            const double *b = in.op == ExpressionParser::Node::PowInt ? nullptr : cols[in.b];
+            ExpressionParser::runKernel(k, in, cols[in.a], b, cols[in.dst], n);
+        }
+        for (int e = 0; e < m_results.size(); ++e) {
+            if (m_results[e] < 0)
+                std::fill(out[e] + base, out[e] + base + n, qQNaN());
+            else
+                std::copy(cols[m_results[e]], cols[m_results[e]] + n, out[e] + base);
+        }
+    }
+}
@@ -0,0 +1,36 @@
+#ifndef EXPRESSIONSET_H
+#define EXPRESSIONSET_H
+
+#include "expressionparser.h"
+#include <QVector>
+
+// Several parsed expressions compiled into one program. Their nodes are
+// merged into a single DAG, so a subexpression that several of them have
+// in common, as exp(-x^2) in a family of variants of a model, is computed
+// once per point for all of them, and one batch pass over the points
+// gives the values of every expression.
+class ExpressionSet
+{
+public:
+    ExpressionSet() = default;
+
+    // Adds parser as expression count() - 1. One that failed to parse is
+    // NaN everywhere.
+    void add(const ExpressionParser &parser);
+    int count() const { return m_roots.size(); }
+    // out[k][i] is expression k at xs[i], for every k below count(); with
+    // ys, at (xs[i], ys[i]), without, y is 0 as in evalBatch().
+    void evalBatch(const double *xs, double *const *out, int count) const;
+    void evalBatch(const double *xs, const double *ys, double *const *out, int count) const;
+    // How many nodes of the expressions, taken as plain trees, were merged
+    // into an identical subexpression, within one of them or across them.
+    int eliminatedNodes() const { return m_merged.m_eliminatedNodes; }
+
+private:
+    // Holds the merged nodes and their program.
+    ExpressionParser m_merged;
+    QVector<int> m_roots; // node of every expression, -1 for none
+    QVector<int> m_results; // register of every expression, -1 for none
+};
+
+#endif // EXPRESSIONSET_H
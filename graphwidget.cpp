@@ -1,12 +1,19 @@
 #include "graphwidget.h"
+#include "expressionset.h"
+#include "quantilesketch.h"
 #include <QPainter>
 #include <QPaintEvent>
 #include <QWheelEvent>
 #include <QMouseEvent>
+#include <QResizeEvent>
+#include <QApplication>
+#include <QElapsedTimer>
 #include <QToolTip>
 #include <QFont>
+#include <QFontMetrics>
 #include <QtMath>
 #include <QtGlobal>
+#include <algorithm>
 #include <cmath>
 
 GraphWidget::GraphWidget(QWidget *parent)
@@ -15,61 +22,294 @@ GraphWidget::GraphWidget(QWidget *parent)
     setBackgroundRole(QPalette::Base);
     setAutoFillBackground(true);
     setSizePolicy(QSizePolicy::Expanding, QSizePolicy::Expanding);
+    m_refineTimer.setSingleShot(true);
+    m_refineTimer.setInterval(0);
+    connect(&m_refineTimer, &QTimer::timeout, this, &GraphWidget::refine);
+    m_renderPool.setMaxThreadCount(1);
+}
+
+GraphWidget::~GraphWidget()
+{
+    if (m_renderCancel)
+        *m_renderCancel = true;
+    m_renderPool.waitForDone();
 }
 
 void GraphWidget::setSamples(const QVector<QPointF> &samples)
 {
-    m_samples = samples;
-    m_hasSamples = !samples.isEmpty();
+    m_curves.clear();
+    Curve curve;
+    curve.color = m_curveColor;
+    curve.samples = samples;
+    m_curves.append(curve);
+    m_hasClickedPoint = false;
+    if (m_autoYRange && !samples.isEmpty()) {
+        QuantileSketch sketch;
+        for (const QPointF &pt : samples)
+            sketch.add(pt.y());
+        double lo, hi;
+        sketch.robustRange(m_autoYQuantile, &lo, &hi);
+        fitYRange(lo, hi);
+    }
+    m_screenStale = true;
+    m_backgroundStale = true;
+    update();
+}
+
+// Fits the y range to [lo, hi], with a small margin. Without any finite
+// value, lo > hi, the range is centred on 0.
+void GraphWidget::fitYRange(double lo, double hi)
+{
+    if (!(lo <= hi))
+        lo = hi = 0;
+    m_yMin = lo;
+    m_yMax = hi;
+    double margin = (m_yMax - m_yMin) * 0.05 + 0.1;
+    if (m_yMax - m_yMin < 0.01) margin = 1;
+    m_yMin -= margin;
+    m_yMax += margin;
+}
+
+// The first curve has the curve color; the others step round the hue
+// circle from it by the golden angle, which keeps neighbours apart
+// however many there are.
+QColor GraphWidget::colorForCurve(int index) const
+{
+    if (index == 0) return m_curveColor;
+    const QColor hsv = m_curveColor.toHsv();
+    const int hue = (qMax(hsv.hue(), 0) + index * 137) % 360;
+    return QColor::fromHsv(hue, qMax(hsv.saturation(), 160), qMax(hsv.value(), 160));
+}
+
+void GraphWidget::setDerivativeSamples(const QVector<QPointF> &samples)
+{
+    if (m_curves.isEmpty()) return;
+    m_curves.first().derivative = samples;
+    m_screenStale = true;
+    update();
+}
+
+void GraphWidget::setExpression(const ExpressionParser &parser)
+{
+    setExpressions({ parser });
+}
+
+void GraphWidget::setExpressions(const QVector<ExpressionParser> &parsers)
+{
+    // An expression that is already plotted, in the same normal form,
+    // keeps its curve and samples.
+    QVector<Curve> old = m_curves;
+    QVector<bool> taken(old.size(), false);
+    m_curves.clear();
+    for (const ExpressionParser &parser : parsers) {
+        Curve curve;
+        for (int i = 0; i < old.size(); ++i) {
+            if (!taken[i] && old[i].parser.isValid() && parser.isValid()
+                && old[i].parser.toString() == parser.toString()) {
+                curve = old[i];
+                taken[i] = true;
+                break;
+            }
+        }
+        if (!curve.parser.isValid()) {
+            curve.parser = parser;
+            curve.stale = parser.isValid();
+        }
+        curve.color = colorForCurve(m_curves.size());
+        m_curves.append(curve);
+    }
     m_hasClickedPoint = false;
-    if (m_autoYRange && m_hasSamples) {
-        m_yMin = m_samples.first().y();
-        m_yMax = m_yMin;
-        for (const QPointF &pt : m_samples) {
-            if (std::isfinite(pt.y())) {
-                m_yMin = qMin(m_yMin, pt.y());
-                m_yMax = qMax(m_yMax, pt.y());
+
+    if (m_autoYRange) {
+        // One pass over a shared grid for the new curves finds where all
+        // of them lie, counting the samples of the kept ones. The grid is
+        // then refined for the fitted range.
+        ExpressionSet set;
+        QVector<int> fresh;
+        QuantileSketch sketch;
+        for (int i = 0; i < m_curves.size(); ++i) {
+            if (m_curves[i].stale) {
+                set.add(m_curves[i].parser);
+                fresh.append(i);
             }
+            for (const QPointF &pt : m_curves[i].samples)
+                sketch.add(pt.y());
+        }
+        const QVector<CurveSampler::Curve> grids
+            = CurveSampler::sampleGrid(set, m_xMin, m_xMax, plotSize(), &sketch);
+        for (int k = 0; k < fresh.size(); ++k)
+            m_curves[fresh[k]].sampled = grids[k];
+        if (!m_curves.isEmpty()) {
+            double lo, hi;
+            sketch.robustRange(m_autoYQuantile, &lo, &hi);
+            fitYRange(lo, hi);
         }
-        double margin = (m_yMax - m_yMin) * 0.05 + 0.1;
-        if (m_yMax - m_yMin < 0.01) margin = 1;
-        m_yMin -= margin;
-        m_yMax += margin;
     }
+    invalidateSamples();
+}
+
+void GraphWidget::addExpression(const ExpressionParser &parser, const QColor &color)
+{
+    Curve curve;
+    curve.parser = parser;
+    curve.color = color.isValid() ? color : colorForCurve(m_curves.size());
+    curve.stale = parser.isValid();
+    m_curves.append(curve);
+    m_pointBudget = COARSE_POINTS;
+    m_refineTimer.start();
+    m_screenStale = true;
     update();
 }
 
+void GraphWidget::setDerivativeVisible(bool visible)
+{
+    if (visible == m_derivativeVisible) return;
+    m_derivativeVisible = visible;
+    for (Curve &curve : m_curves)
+        curve.derivative.clear();
+    invalidateSamples();
+}
+
 void GraphWidget::setXRange(double xMin, double xMax)
 {
+    if (xMin == m_xMin && xMax == m_xMax) return;
     m_xMin = xMin;
     m_xMax = xMax;
-    update();
+    invalidateSamples();
 }
 
 void GraphWidget::setYRange(double yMin, double yMax)
 {
     m_autoYRange = false;
+    if (yMin == m_yMin && yMax == m_yMax) return;
     m_yMin = yMin;
     m_yMax = yMax;
+    invalidateSamples();
+}
+
+// Called whenever the view changes. Curves of expressions are brought up
+// to date once the event loop is idle, so a burst of wheel or drag events
+// costs a single resampling.
+void GraphWidget::invalidateSamples()
+{
+    for (Curve &curve : m_curves) {
+        if (curve.parser.isValid())
+            curve.stale = true;
+    }
+    m_pointBudget = COARSE_POINTS;
+    m_refineTimer.start();
+    m_screenStale = true;
+    m_backgroundStale = true;
     update();
 }
 
+// Samples the curves that are stale, within the budget of the pass. Those
+// with nothing to start from, when there are several, first get a shared
+// grid in one fused pass.
+void GraphWidget::updateSamples()
+{
+    QElapsedTimer timer;
+    timer.start();
+    ExpressionSet set;
+    QVector<int> fresh;
+    for (int i = 0; i < m_curves.size(); ++i) {
+        if (m_curves[i].stale && m_curves[i].sampled.points.isEmpty()) {
+            set.add(m_curves[i].parser);
+            fresh.append(i);
+        }
+    }
+    if (fresh.size() > 1) {
+        const QVector<CurveSampler::Curve> grids = CurveSampler::sampleGrid(set, m_xMin, m_xMax, plotSize());
+        for (int k = 0; k < fresh.size(); ++k)
+            m_curves[fresh[k]].sampled = grids[k];
+    }
+    bool sampled = false;
+    for (Curve &curve : m_curves) {
+        if (curve.stale) {
+            resample(curve);
+            sampled = true;
+        }
+    }
+    if (sampled) {
+        m_passNsecs = timer.nsecsElapsed();
+        m_screenStale = true;
+    }
+}
+
+// Runs a pass: the coarse one on the curves that are stale, or else the
+// next, finer one on those the last pass left unfinished. A pass that was
+// quick lets the next take up to four times as many points; a slow one
+// makes it take fewer.
+void GraphWidget::refine()
+{
+    bool stale = false;
+    for (const Curve &curve : m_curves)
+        stale = stale || curve.stale;
+    if (!stale) {
+        const double scale = qMin(4.0, double(FRAME_NSECS) / qMax(m_passNsecs, qint64(1)));
+        m_pointBudget = qBound(int(MIN_PASS_POINTS), int(m_pointBudget * scale), int(CurveSampler::DefaultMaxPoints));
+        for (Curve &curve : m_curves) {
+            if (curve.refining)
+                curve.stale = true;
+        }
+    }
+    updateSamples();
+    update();
+}
+
+void GraphWidget::resample(Curve &curve) const
+{
+    curve.stale = false;
+    CurveSampler sampler(curve.parser);
+    const int budget = qMin(int(curve.sampled.points.size()) + m_pointBudget, int(CurveSampler::DefaultMaxPoints));
+    sampler.setMaxPoints(budget);
+    curve.sampled = sampler.sample(m_xMin, m_xMax, m_yMin, m_yMax, plotSize(), curve.sampled);
+    curve.refining = !curve.sampled.complete && budget < CurveSampler::DefaultMaxPoints;
+
+    QVector<QPointF> derivative;
+    if (m_derivativeVisible) {
+        // Points kept from the last view keep their slope as well.
+        const QVector<QPointF> &samples = curve.samples;
+        const bool reuse = curve.derivative.size() == samples.size();
+        derivative.reserve(curve.sampled.points.size());
+        int j = 0;
+        for (const QPointF &pt : curve.sampled.points) {
+            while (reuse && j < samples.size() && samples[j].x() < pt.x())
+                ++j;
+            double slope;
+            if (std::isnan(pt.y()))
+                slope = pt.y();
+            else if (reuse && j < samples.size() && samples[j].x() == pt.x())
+                slope = curve.derivative[j].y();
+            else
+                slope = curve.parser.evalGradient(pt.x()).dx;
+            derivative.append(QPointF(pt.x(), slope));
+        }
+    }
+    curve.samples = curve.sampled.points;
+    curve.derivative = derivative;
+}
+
 void GraphWidget::setCurveColor(const QColor &c)
 {
     if (c.isValid()) {
         m_curveColor = c;
+        for (int i = 0; i < m_curves.size(); ++i)
+            m_curves[i].color = colorForCurve(i);
+        m_screenStale = true;
         update();
     }
 }
 
 void GraphWidget::clear()
 {
-    m_samples.clear();
-    m_hasSamples = false;
+    m_curves.clear();
     m_hasClickedPoint = false;
     m_autoYRange = true;
     m_yMin = -3;
     m_yMax = 3;
+    m_screenStale = true;
+    m_backgroundStale = true;
     update();
 }
 
@@ -107,20 +347,21 @@ QPointF GraphWidget::mapFromWidget(QPointF screenPos) const
     return QPointF(x, y);
 }
 
+// The first curve's y at x, interpolated between the samples on either
+// side. The samples are in increasing x, so those are found by bisection.
 double GraphWidget::valueAtX(double x) const
 {
-    if (m_samples.size() < 2) return qQNaN();
-    if (x <= m_samples.first().x()) return m_samples.first().y();
-    if (x >= m_samples.last().x()) return m_samples.last().y();
-    for (int i = 0; i < m_samples.size() - 1; ++i) {
-        if (m_samples[i].x() <= x && x <= m_samples[i + 1].x()) {
-            const QPointF &a = m_samples[i];
-            const QPointF &b = m_samples[i + 1];
-            double t = (b.x() - a.x()) > 1e-30 ? (x - a.x()) / (b.x() - a.x()) : 0;
-            return a.y() + t * (b.y() - a.y());
-        }
-    }
-    return qQNaN();
+    if (m_curves.isEmpty()) return qQNaN();
+    const QVector<QPointF> &samples = m_curves.first().samples;
+    if (samples.size() < 2) return qQNaN();
+    if (x <= samples.first().x()) return samples.first().y();
+    if (x >= samples.last().x()) return samples.last().y();
+    const auto next = std::upper_bound(samples.cbegin(), samples.cend(), x,
+                                       [](double v, const QPointF &pt) { return v < pt.x(); });
+    const QPointF &a = *(next - 1);
+    const QPointF &b = *next;
+    double t = (b.x() - a.x()) > 1e-30 ? (x - a.x()) / (b.x() - a.x()) : 0;
+    return a.y() + t * (b.y() - a.y());
 }
 
 void GraphWidget::drawClickedPoint(QPainter &p) const
@@ -135,6 +376,83 @@ void GraphWidget::drawClickedPoint(QPainter &p) const
     p.drawLine(screen.toPoint() + QPoint(0, -10), screen.toPoint() + QPoint(0, 10));
 }
 
+void GraphWidget::setCrosshairVisible(bool visible)
+{
+    if (visible == m_crosshairVisible) return;
+    m_crosshairVisible = visible;
+    setMouseTracking(visible);
+    if (!visible)
+        setHoverPos(QPointF(-1, -1));
+}
+
+// Moves the crosshair to pos, or hides it for a pos outside the plot.
+// Only the pixels it covered and covers now are repainted, so tracking
+// the mouse costs little however large the widget.
+void GraphWidget::setHoverPos(const QPointF &pos)
+{
+    const bool inPlot = m_crosshairVisible && pos.x() >= MARGIN && pos.x() <= width() - MARGIN
+        && pos.y() >= MARGIN && pos.y() <= height() - MARGIN;
+    if (!inPlot && !m_hasHover) return;
+    for (const QRect &r : crosshairRects())
+        update(r);
+    m_hasHover = inPlot;
+    m_hoverPos = pos;
+    for (const QRect &r : crosshairRects())
+        update(r);
+}
+
+QString GraphWidget::crosshairText(double x, double y) const
+{
+    if (!std::isfinite(y))
+        return tr("x = %1").arg(x, 0, 'g', 6);
+    return tr("x = %1, y = %2").arg(x, 0, 'g', 6).arg(y, 0, 'g', 6);
+}
+
+// The areas the crosshair is drawn in: the line, the mark on the curve
+// and the label. Empty when it is hidden.
+QVector<QRect> GraphWidget::crosshairRects() const
+{
+    QVector<QRect> rects;
+    if (!m_hasHover) return rects;
+    const int x = qRound(m_hoverPos.x());
+    rects.append(QRect(x - 2, MARGIN, 5, height() - 2 * MARGIN + 1));
+    const double dataX = mapFromWidget(m_hoverPos).x();
+    const double y = valueAtX(dataX);
+    if (std::isfinite(y)) {
+        const QPoint mark = mapToWidget(dataX, y).toPoint();
+        rects.append(QRect(mark - QPoint(6, 6), QSize(13, 13)));
+    }
+    const QFontMetrics fm(font());
+    const QSize size(fm.horizontalAdvance(crosshairText(dataX, y)) + 8, fm.height() + 4);
+    const int left = x + 6 + size.width() <= width() - MARGIN ? x + 6 : x - 6 - size.width();
+    rects.append(QRect(QPoint(left, MARGIN + 4), size));
+    return rects;
+}
+
+void GraphWidget::drawCrosshair(QPainter &p) const
+{
+    if (!m_hasHover) return;
+    const QVector<QRect> rects = crosshairRects();
+    const double dataX = mapFromWidget(m_hoverPos).x();
+    const double y = valueAtX(dataX);
+    const int x = qRound(m_hoverPos.x());
+    p.setRenderHint(QPainter::Antialiasing, false);
+    p.setPen(QPen(palette().color(QPalette::WindowText), 1, Qt::DashLine));
+    p.drawLine(QPoint(x, MARGIN), QPoint(x, height() - MARGIN));
+    if (std::isfinite(y)) {
+        p.setRenderHint(QPainter::Antialiasing, true);
+        p.setPen(QPen(m_curves.first().color, 2));
+        p.setBrush(palette().color(QPalette::Base));
+        p.drawEllipse(mapToWidget(dataX, y), 4.0, 4.0);
+    }
+    const QRect &label = rects.last();
+    p.setFont(font());
+    p.setPen(palette().color(QPalette::WindowText));
+    p.setBrush(palette().color(QPalette::ToolTipBase));
+    p.drawRect(label.adjusted(0, 0, -1, -1));
+    p.drawText(label, Qt::AlignCenter, crosshairText(dataX, y));
+}
+
 QVector<double> GraphWidget::tickValues(double minVal, double maxVal, int maxTicks) const
 {
     QVector<double> ticks;
@@ -217,28 +535,205 @@ void GraphWidget::drawAxisLabels(QPainter &p) const
     }
 }
 
-void GraphWidget::drawCurve(QPainter &p) const
+// Renders the grid, the axes and their labels, which only change with the
+// ranges, the size and the palette, so that paints in between just copy
+// them. Laying out the labels is the costliest part of a frame otherwise.
+void GraphWidget::updateBackground()
 {
-    if (m_samples.size() < 2) return;
+    const qreal dpr = devicePixelRatio();
+    if (!m_backgroundStale && m_background.devicePixelRatio() == dpr) return;
+    m_backgroundStale = false;
+    m_background = QPixmap(size() * dpr);
+    m_background.setDevicePixelRatio(dpr);
+    m_background.fill(palette().color(QPalette::Base));
+    QPainter p(&m_background);
+    p.setFont(font());
+    drawGrid(p);
+    drawAxes(p);
+    drawAxisLabels(p);
+}
 
-    p.setPen(QPen(m_curveColor, 2));
-    p.setRenderHint(QPainter::SmoothPixmapTransform, true);
+GraphWidget::View GraphWidget::currentView() const
+{
+    return { m_xMin, m_xMax, m_yMin, m_yMax, size(), devicePixelRatio() };
+}
+
+// Hands the curves, as they are now, to the worker to draw for view. Their
+// samples are shared, not copied, and left alone by the widget, which
+// replaces them rather than changing them.
+void GraphWidget::startRender(const View &view)
+{
+    m_screenStale = false;
+    m_renderView = view;
+    if (m_renderCancel)
+        *m_renderCancel = true;
+    auto cancel = std::make_shared<std::atomic<bool>>(false);
+    m_renderCancel = cancel;
+    const int generation = ++m_renderGeneration;
+    QVector<Stroke> strokes;
+    strokes.reserve(m_curves.size());
+    for (const Curve &curve : m_curves)
+        strokes.append({ curve.samples, curve.derivative, curve.color });
+    m_renderPool.start([this, strokes, view, cancel, generation]() {
+        const QImage image = renderCurves(strokes, view, *cancel);
+        if (*cancel) return;
+        QMetaObject::invokeMethod(this, [this, generation, image, view]() {
+            finishRender(generation, image, view);
+        }, Qt::QueuedConnection);
+    });
+}
+
+void GraphWidget::finishRender(int generation, const QImage &image, const View &view)
+{
+    if (generation != m_renderGeneration) return;
+    m_curveLayer = image;
+    m_layerView = view;
+    update();
+    // The next pass only once this one is on screen.
+    for (const Curve &curve : m_curves) {
+        if (curve.refining) {
+            m_refineTimer.start();
+            break;
+        }
+    }
+}
+
+// Runs on the worker. Gives up, with a null image, as soon as cancel is
+// set.
+QImage GraphWidget::renderCurves(const QVector<Stroke> &strokes, const View &view, const std::atomic<bool> &cancel)
+{
+    if (view.size.isEmpty()) return QImage();
+    QImage image(view.size * view.devicePixelRatio, QImage::Format_ARGB32_Premultiplied);
+    image.setDevicePixelRatio(view.devicePixelRatio);
+    image.fill(Qt::transparent);
+    QPainter p(&image);
     p.setRenderHint(QPainter::Antialiasing, true);
+    for (const Stroke &stroke : strokes) {
+        if (cancel) return QImage();
+        p.setPen(QPen(stroke.color, 1.5, Qt::DashLine));
+        drawPolyline(p, decimate(stroke.derivative, view), cancel);
+        if (cancel) return QImage();
+        p.setPen(QPen(stroke.color, 2));
+        drawPolyline(p, decimate(stroke.samples, view), cancel);
+    }
+    return image;
+}
+
+// Maps samples to widget coordinates and keeps, of each run of samples
+// that fall in the same pixel column, only the first, the last and the
+// lowest and highest in between, in their original order. The lines
+// between those cover the same pixels as the lines between all of them,
+// so a curve costs a few points per column however many samples it has.
+// Columns off the widget are merged into one on either side. Samples with
+// x or y not finite split the curve into separate runs.
+GraphWidget::Polyline GraphWidget::decimate(const QVector<QPointF> &samples, const View &view)
+{
+    Polyline polyline;
+    const int width = view.size.width();
+    const double w = width - 2 * MARGIN;
+    const double h = view.size.height() - 2 * MARGIN;
+    if (samples.size() < 2 || w <= 0 || h <= 0) return polyline;
 
-    QPointF prev = mapToWidget(m_samples.first().x(), m_samples.first().y());
-    for (int i = 1; i < m_samples.size(); ++i) {
-        const QPointF &pt = m_samples.at(i);
-        if (!std::isfinite(pt.y())) {
-            if (i + 1 < m_samples.size())
-                prev = mapToWidget(m_samples.at(i + 1).x(), m_samples.at(i + 1).y());
+    double xRange = view.xMax - view.xMin;
+    double yRange = view.yMax - view.yMin;
+    if (qAbs(xRange) < 1e-30) xRange = 1e-30;
+    if (qAbs(yRange) < 1e-30) yRange = 1e-30;
+    const double kx = w / xRange;
+    const double ky = h / yRange;
+
+    QVector<QPointF> &points = polyline.points;
+    points.reserve(qMin(int(samples.size()), 4 * (width + 2)));
+    // The run in the current column, by index into samples.
+    int column = 0;
+    int first = -1, last = -1, low = -1, high = -1;
+    QPointF firstPt, lastPt, lowPt, highPt;
+    auto flush = [&]() {
+        if (first < 0) return;
+        points.append(firstPt);
+        if (low < high) {
+            if (low != first) points.append(lowPt);
+            if (high != last) points.append(highPt);
+        } else if (high < low) {
+            if (high != first) points.append(highPt);
+            if (low != last) points.append(lowPt);
+        }
+        if (last != first) points.append(lastPt);
+        first = -1;
+    };
+    // Ends the current run; a single point draws nothing and is dropped.
+    int runStart = 0;
+    auto endRun = [&]() {
+        flush();
+        if (points.size() - runStart >= 2)
+            polyline.runEnds.append(points.size());
+        else
+            points.resize(runStart);
+        runStart = points.size();
+    };
+    for (int i = 0; i < samples.size(); ++i) {
+        const QPointF &s = samples.at(i);
+        if (!std::isfinite(s.x()) || !std::isfinite(s.y())) {
+            endRun();
             continue;
         }
-        QPointF cur = mapToWidget(pt.x(), pt.y());
-        p.drawLine(prev.toPoint(), cur.toPoint());
-        prev = cur;
+        const QPointF pt(MARGIN + (s.x() - view.xMin) * kx, MARGIN + (view.yMax - s.y()) * ky);
+        const int c = pt.x() < 0 ? -1 : pt.x() >= width ? width : int(pt.x());
+        if (first < 0 || c != column) {
+            flush();
+            column = c;
+            first = last = low = high = i;
+            firstPt = lastPt = lowPt = highPt = pt;
+            continue;
+        }
+        last = i;
+        lastPt = pt;
+        // Widget y grows downwards: the lowest point has the largest y.
+        if (pt.y() > lowPt.y()) {
+            low = i;
+            lowPt = pt;
+        } else if (pt.y() < highPt.y()) {
+            high = i;
+            highPt = pt;
+        }
+    }
+    endRun();
+    return polyline;
+}
+
+void GraphWidget::drawPolyline(QPainter &p, const Polyline &polyline, const std::atomic<bool> &cancel)
+{
+    int start = 0;
+    for (int end : polyline.runEnds) {
+        if (cancel) return;
+        p.drawPolyline(polyline.points.constData() + start, end - start);
+        start = end;
     }
 }
 
+// Draws the last curve layer the worker finished. One drawn for other
+// ranges or another size is stretched so that its curves line up with
+// the current ranges, until the layer for those is ready.
+void GraphWidget::drawCurveLayer(QPainter &p) const
+{
+    if (m_curveLayer.isNull()) return;
+    const View &v = m_layerView;
+    if (v.xMin == m_xMin && v.xMax == m_xMax && v.yMin == m_yMin && v.yMax == m_yMax && v.size == size()) {
+        p.drawImage(0, 0, m_curveLayer);
+        return;
+    }
+    // The widget corners of the layer, in data coordinates, mapped to the
+    // widget as it is now.
+    const double w = v.size.width() - 2 * MARGIN;
+    const double h = v.size.height() - 2 * MARGIN;
+    if (w <= 0 || h <= 0) return;
+    const double kx = (v.xMax - v.xMin) / w, ky = (v.yMax - v.yMin) / h;
+    const QPointF topLeft = mapToWidget(v.xMin - MARGIN * kx, v.yMax + MARGIN * ky);
+    const QPointF bottomRight = mapToWidget(v.xMin + (v.size.width() - MARGIN) * kx,
+                                            v.yMax - (v.size.height() - MARGIN) * ky);
+    p.setRenderHint(QPainter::SmoothPixmapTransform, true);
+    p.drawImage(QRectF(topLeft, bottomRight), m_curveLayer);
+}
+
 void GraphWidget::wheelEvent(QWheelEvent *event)
 {
     double factor = event->angleDelta().y() > 0 ? 0.85 : 1.0 / 0.85;
@@ -261,12 +756,15 @@ void GraphWidget::zoomAtCenter(double factor)
     m_yMin = yCenter - yHalf;
     m_yMax = yCenter + yHalf;
     m_autoYRange = false;
-    update();
+    invalidateSamples();
 }
 
 void GraphWidget::mousePressEvent(QMouseEvent *event)
 {
     if (event->button() != Qt::LeftButton) return;
+    m_dragStart = event->position();
+    m_lastDragPos = m_dragStart;
+    m_dragging = false;
     QPointF screenPos = event->position().toPoint();
     const double margin = MARGIN;
     if (screenPos.x() < margin || screenPos.x() > width() - margin
@@ -275,6 +773,7 @@ void GraphWidget::mousePressEvent(QMouseEvent *event)
         update();
         return;
     }
+    updateSamples();
     m_clickedDataPoint = mapFromWidget(screenPos);
     m_clickedCurveY = valueAtX(m_clickedDataPoint.x());
     m_hasClickedPoint = true;
@@ -288,15 +787,78 @@ void GraphWidget::mousePressEvent(QMouseEvent *event)
     update();
 }
 
-void GraphWidget::paintEvent(QPaintEvent *event)
+// Dragging with the left button pans the view. Until the mouse has moved
+// a little, the press still counts as a click on the curve.
+void GraphWidget::mouseMoveEvent(QMouseEvent *event)
+{
+    const QPointF pos = event->position();
+    if (!(event->buttons() & Qt::LeftButton)) {
+        setHoverPos(pos);
+        return;
+    }
+    if (!m_dragging) {
+        if ((pos - m_dragStart).manhattanLength() < QApplication::startDragDistance()) return;
+        m_dragging = true;
+        m_hasClickedPoint = false;
+        m_hasHover = false;
+        QToolTip::hideText();
+        setCursor(Qt::ClosedHandCursor);
+    }
+    const QPointF from = mapFromWidget(m_lastDragPos);
+    const QPointF to = mapFromWidget(pos);
+    m_xMin += from.x() - to.x();
+    m_xMax += from.x() - to.x();
+    m_yMin += from.y() - to.y();
+    m_yMax += from.y() - to.y();
+    m_lastDragPos = pos;
+    m_autoYRange = false;
+    invalidateSamples();
+}
+
+void GraphWidget::mouseReleaseEvent(QMouseEvent *event)
+{
+    if (event->button() != Qt::LeftButton || !m_dragging) return;
+    m_dragging = false;
+    unsetCursor();
+    setHoverPos(event->position());
+}
+
+void GraphWidget::leaveEvent(QEvent *event)
 {
     Q_UNUSED(event);
-    QPainter p(this);
-    p.fillRect(rect(), palette().color(QPalette::Base));
+    setHoverPos(QPointF(-1, -1));
+}
 
-    drawGrid(p);
-    drawAxes(p);
-    drawAxisLabels(p);
-    drawCurve(p);
-    drawClickedPoint(p);
+void GraphWidget::resizeEvent(QResizeEvent *event)
+{
+    Q_UNUSED(event);
+    invalidateSamples();
+}
+
+void GraphWidget::changeEvent(QEvent *event)
+{
+    if (event->type() == QEvent::PaletteChange || event->type() == QEvent::FontChange) {
+        m_backgroundStale = true;
+        update();
+    }
+    QWidget::changeEvent(event);
+}
+
+void GraphWidget::paintEvent(QPaintEvent *event)
+{
+    Q_UNUSED(event);
+    QElapsedTimer timer;
+    timer.start();
+    const View view = currentView();
+    if (m_screenStale || view != m_renderView)
+        startRender(view);
+    updateBackground();
+    {
+        QPainter p(this);
+        p.drawPixmap(0, 0, m_background);
+        drawCurveLayer(p);
+        drawClickedPoint(p);
+        drawCrosshair(p);
+    }
+    emit painted(timer.nsecsElapsed());
 }
@@ -1,10 +1,18 @@
 #ifndef GRAPHWIDGET_H
 #define GRAPHWIDGET_H
 
+#include "curvesampler.h"
+#include "expressionparser.h"
 #include <QWidget>
 #include <QVector>
 #include <QPointF>
 #include <QColor>
+#include <QPixmap>
+#include <QImage>
+#include <QTimer>
+#include <QThreadPool>
+#include <atomic>
+#include <memory>
 
 class GraphWidget : public QWidget
 {
@@ -12,48 +20,192 @@ class GraphWidget : public QWidget
 
 public:
     explicit GraphWidget(QWidget *parent = nullptr);
+    ~GraphWidget() override;
 
+    // Plots fixed samples, in increasing x, as the only curve; y NaN
+    // leaves a gap.
     void setSamples(const QVector<QPointF> &samples);
+    // The derivative of the first curve, drawn dashed in its color; empty
+    // for none.
+    void setDerivativeSamples(const QVector<QPointF> &samples);
+    // Plots y = f(x) for the parsed expression as the only curve. Curves
+    // of expressions are sampled for the visible range and sampled again
+    // after every zoom, pan or resize, reusing what the last view
+    // evaluated.
+    void setExpression(const ExpressionParser &parser);
+    // Plots one curve per expression. Curves of expressions that were
+    // already plotted are kept as they are; the new ones are sampled
+    // together, with the subexpressions they share evaluated once, and
+    // the automatic y range fits all of them.
+    void setExpressions(const QVector<ExpressionParser> &parsers);
+    // Adds a curve for the expression, in color or, if that is invalid,
+    // the next color after the curve color. The other curves are not
+    // evaluated again.
+    void addExpression(const ExpressionParser &parser, const QColor &color = QColor());
+    int curveCount() const { return m_curves.size(); }
+    // With expressions, also plots f'(x) for each of them.
+    void setDerivativeVisible(bool visible);
     void setXRange(double xMin, double xMax);
     void setYRange(double yMin, double yMax);
     void setAutoYRange(bool autoY) { m_autoYRange = autoY; }
+    // The automatic y range covers the values from quantile q to 1 - q,
+    // out to the least and greatest when those are not far beyond, so
+    // that the values near a pole do not flatten the rest of the curve.
+    // 0.005 by default; 0 fits all of them.
+    void setAutoYQuantile(double q) { m_autoYQuantile = qBound(0.0, q, 0.5); }
+    // Shows a vertical line under the mouse with x and the first curve's
+    // y there.
+    void setCrosshairVisible(bool visible);
+    // The color of the first curve. The others get hues spread out from it.
     void setCurveColor(const QColor &c);
     QColor curveColor() const { return m_curveColor; }
+    // Size in pixels of the area the curve is drawn in.
+    QSize plotSize() const { return QSize(width() - 2 * MARGIN, height() - 2 * MARGIN); }
     void clear();
 
     QSize minimumSizeHint() const override { return QSize(400, 300); }
 
+signals:
+    // Emitted after every paint with the time it took, for profiling. The
+    // curves are drawn on a worker thread and not included.
+    void painted(qint64 nsecs);
+
 protected:
     void paintEvent(QPaintEvent *event) override;
     void wheelEvent(QWheelEvent *event) override;
     void mousePressEvent(QMouseEvent *event) override;
+    void mouseMoveEvent(QMouseEvent *event) override;
+    void mouseReleaseEvent(QMouseEvent *event) override;
+    void leaveEvent(QEvent *event) override;
+    void resizeEvent(QResizeEvent *event) override;
+    void changeEvent(QEvent *event) override;
 
 private:
+    // The ranges and size a curve layer is drawn for.
+    struct View {
+        double xMin, xMax, yMin, yMax;
+        QSize size;
+        qreal devicePixelRatio;
+        bool operator==(const View &o) const
+        {
+            return xMin == o.xMin && xMax == o.xMax && yMin == o.yMin && yMax == o.yMax
+                && size == o.size && devicePixelRatio == o.devicePixelRatio;
+        }
+        bool operator!=(const View &o) const { return !(*this == o); }
+    };
+
+    // What the renderer takes of a curve: its samples, shared with the
+    // widget, and color.
+    struct Stroke {
+        QVector<QPointF> samples;
+        QVector<QPointF> derivative;
+        QColor color;
+    };
+
+    // A curve in widget coordinates, as drawn: runs of points joined by
+    // lines, stored one after the other. The gaps between runs are not
+    // drawn.
+    struct Polyline {
+        QVector<QPointF> points;
+        QVector<int> runEnds; // index in points after each run
+    };
+
+    // The function, or the fixed samples, of one curve.
+    struct Curve {
+        ExpressionParser parser; // not valid for fixed samples
+        QColor color;
+        bool stale = false; // samples are for another view
+        bool refining = false; // sampled within a pass budget, not finished
+        CurveSampler::Curve sampled;
+        QVector<QPointF> samples;
+        QVector<QPointF> derivative;
+    };
+
+private slots:
+    void refine();
+
+private:
+
     void zoomAtCenter(double factor);
+    void fitYRange(double lo, double hi);
+    QColor colorForCurve(int index) const;
+    void invalidateSamples();
+    void updateSamples();
+    void resample(Curve &curve) const;
     QPointF mapFromWidget(QPointF screenPos) const;
     double valueAtX(double x) const;
     void drawClickedPoint(QPainter &p) const;
+    void setHoverPos(const QPointF &pos);
+    QString crosshairText(double x, double y) const;
+    QVector<QRect> crosshairRects() const;
+    void drawCrosshair(QPainter &p) const;
 
-    QVector<QPointF> m_samples;
+    QVector<Curve> m_curves;
     double m_xMin = -3;
     double m_xMax = 3;
     double m_yMin = -3;
     double m_yMax = 3;
     bool m_autoYRange = true;
-    bool m_hasSamples = false;
+    double m_autoYQuantile = 0.005;
     bool m_hasClickedPoint = false;
     QPointF m_clickedDataPoint;
     double m_clickedCurveY = 0;
     QColor m_curveColor = QColor(0, 100, 200);
 
+    bool m_derivativeVisible = false;
+    bool m_dragging = false;
+    QPointF m_dragStart;
+    QPointF m_lastDragPos;
+    bool m_crosshairVisible = false;
+    bool m_hasHover = false;
+    QPointF m_hoverPos; // widget coordinates
+
+    // The curves are drawn into m_curveLayer by a worker, for the view in
+    // m_layerView, while the widget goes on with the last image: shown as
+    // it is if the view is the same, stretched to the new ranges if not.
+    // Starting another render cancels the one in flight, whose image is
+    // dropped. m_screenStale is set when the curves or their colors
+    // change, which the view alone does not tell.
+    QImage m_curveLayer;
+    View m_layerView = {};
+    View m_renderView = {};
+    bool m_screenStale = true;
+    int m_renderGeneration = 0;
+    std::shared_ptr<std::atomic<bool>> m_renderCancel;
+    QThreadPool m_renderPool;
+    // The grid, axes and labels, at the screen's pixel density, for the
+    // current ranges, size and palette.
+    QPixmap m_background;
+    bool m_backgroundStale = true;
+
+    // Curves of expressions are sampled in passes, run from the event loop
+    // by m_refineTimer and each adding at most m_pointBudget points to a
+    // curve: a coarse one first, then ever finer ones, each sized from the
+    // time the last one took to stay within about a frame and started once
+    // the last is drawn. A change of view or expressions starts again from
+    // a coarse pass.
+    QTimer m_refineTimer;
+    int m_pointBudget = COARSE_POINTS;
+    qint64 m_passNsecs = 0;
+
+    View currentView() const;
     QPointF mapToWidget(double x, double y) const;
     QVector<double> tickValues(double minVal, double maxVal, int maxTicks) const;
     void drawGrid(QPainter &p) const;
     void drawAxes(QPainter &p) const;
     void drawAxisLabels(QPainter &p) const;
-    void drawCurve(QPainter &p) const;
+    void updateBackground();
+    void startRender(const View &view);
+    void finishRender(int generation, const QImage &image, const View &view);
+    void drawCurveLayer(QPainter &p) const;
+    static QImage renderCurves(const QVector<Stroke> &strokes, const View &view, const std::atomic<bool> &cancel);
+    static Polyline decimate(const QVector<QPointF> &samples, const View &view);
+    static void drawPolyline(QPainter &p, const Polyline &polyline, const std::atomic<bool> &cancel);
 
     static const int MARGIN = 48;
+    static const int COARSE_POINTS = 256;
+    static const int MIN_PASS_POINTS = 32;
+    static const qint64 FRAME_NSECS = 12000000;
 };
 
 #endif // GRAPHWIDGET_H
@@ -4,6 +4,7 @@
 #include <QMouseEvent>
 #include <QWheelEvent>
 #include <QToolTip>
+#include <QElapsedTimer>
 #include <QtMath>
 #include <cmath>
 #include <algorithm>
@@ -16,37 +17,236 @@ GraphWidget3D::GraphWidget3D(QWidget *parent)
     setAutoFillBackground(true);
     setSizePolicy(QSizePolicy::Expanding, QSizePolicy::Expanding);
     setFocusPolicy(Qt::StrongFocus);
+    m_refineTimer.setSingleShot(true);
+    m_refineTimer.setInterval(0);
+    connect(&m_refineTimer, &QTimer::timeout, this, &GraphWidget3D::refine);
+    m_idleTimer.setSingleShot(true);
+    m_idleTimer.setInterval(IDLE_MSECS);
+    connect(&m_idleTimer, &QTimer::timeout, this, &GraphWidget3D::endInteraction);
+    m_rasterPool.setMaxThreadCount(1);
 }
 
-void GraphWidget3D::setSurface(const QVector<QVector<Point3D>> &grid)
+GraphWidget3D::~GraphWidget3D()
 {
-    m_grid = grid;
-    m_hasSurface = !grid.isEmpty() && !grid.first().isEmpty();
+    m_rasterPool.waitForDone();
+}
+
+void GraphWidget3D::setSurface(const HeightField &surface)
+{
+    m_parser = ExpressionParser();
+    m_refineTimer.stop();
+    m_surface = surface;
+    m_step = 1;
+    buildLevels();
+    m_rasterStale = true;
+    m_hasSurface = !surface.isEmpty();
+    m_zSketch.clear();
+    m_zSketch.add(surface.constData(), int(surface.size()));
     m_zoomFactor = 1.8;
     m_hasClickedPoint = false;
-    if (m_autoZRange && m_hasSurface) {
-        m_zMin = m_grid.first().first().z;
-        m_zMax = m_zMin;
-        for (const auto &row : m_grid) {
-            for (const Point3D &p : row) {
-                if (std::isfinite(p.z)) {
-                    m_zMin = qMin(m_zMin, p.z);
-                    m_zMax = qMax(m_zMax, p.z);
-                }
+    fitZRange();
+    m_labelsStale = true;
+    update();
+}
+
+void GraphWidget3D::setExpression(const ExpressionParser &parser)
+{
+    m_parser = parser;
+    m_step = 0;
+    m_refineTimer.stop();
+    m_surface = HeightField();
+    m_levels.clear();
+    m_levelNsecs.clear();
+    m_level = 0;
+    m_hasSurface = false;
+    m_zoomFactor = 1.8;
+    m_hasClickedPoint = false;
+    update();
+}
+
+// The first pass evaluates every COARSE_STEP-th point in x and y, each
+// later one the points halfway between those of the pass before: the rows
+// in between, and the points in between on the rows already there. A pass
+// is run in chunks of whole rows, each of about m_pointBudget points, and
+// counts as done, with m_step halved, once its last row is in. Returns
+// whether a pass was done.
+bool GraphWidget3D::samplePass()
+{
+    const int n = GRID_SIZE + 1;
+    QElapsedTimer timer;
+    timer.start();
+    int points = 0;
+    // Points j0, j0 + jStep, ... of each of rows.
+    auto evaluate = [&](const QVector<int> &rows, int j0, int jStep) {
+        if (rows.isEmpty()) return;
+        QVector<double> xs, ys;
+        for (int i : rows)
+            xs.append(m_surface.x(i));
+        for (int j = j0; j < n; j += jStep)
+            ys.append(m_surface.y(j));
+        QVector<double> zs(xs.size() * ys.size());
+        m_parser.evalGrid(xs.constData(), xs.size(), ys.constData(), ys.size(), zs.data());
+        m_zSketch.add(zs.constData(), zs.size());
+        for (int a = 0; a < xs.size(); ++a) {
+            for (int b = 0; b < ys.size(); ++b)
+                m_surface.setZ(rows[a], j0 + b * jStep, zs[a * ys.size() + b]);
+        }
+        points += zs.size();
+    };
+    bool done = true;
+    if (m_step == 0) {
+        m_surface = HeightField(n, n, m_xMin, m_xMax, m_yMin, m_yMax);
+        m_levels.clear();
+        m_levelNsecs.clear();
+        m_level = 0;
+        m_zSketch.clear();
+        QVector<int> rows;
+        for (int i = 0; i < n; i += COARSE_STEP)
+            rows.append(i);
+        evaluate(rows, 0, COARSE_STEP);
+        m_step = COARSE_STEP;
+        m_nextRow = 0;
+    } else {
+        const int half = m_step / 2;
+        QVector<int> between, existing;
+        for (int budget = 0; m_nextRow < n && budget < m_pointBudget; m_nextRow += half) {
+            if (m_nextRow % m_step) {
+                between.append(m_nextRow);
+                budget += (n - 1) / half + 1;
+            } else {
+                existing.append(m_nextRow);
+                budget += (n - 1 - half) / m_step + 1;
             }
         }
+        evaluate(between, 0, half);
+        evaluate(existing, half, m_step);
+        done = m_nextRow >= n;
+        if (done) {
+            m_step = half;
+            m_nextRow = 0;
+        }
+    }
+    // As in GraphWidget::refine(): up to four times as many points when
+    // this chunk was quick, fewer when it was slow.
+    const double scale = qMin(4.0, double(FRAME_NSECS) / qMax(timer.nsecsElapsed(), qint64(1)));
+    m_pointBudget = qMax(int(points * scale), int(MIN_PASS_POINTS));
+    if (!done)
+        return false;
+    m_hasSurface = true;
+    m_rasterStale = true;
+    if (m_autoZRange)
+        m_labelsStale = true;
+    fitZRange();
+    return true;
+}
+
+// Runs the next chunk, and draws the surface once a pass is done; until
+// then the chunks follow one another without drawing in between.
+void GraphWidget3D::refine()
+{
+    if (samplePass())
+        update();
+    else
+        m_refineTimer.start();
+}
+
+// Back to the surface itself once the view is released or at rest.
+void GraphWidget3D::endInteraction()
+{
+    m_idleTimer.stop();
+    m_interacting = false;
+    if (m_level > 0)
+        update();
+}
+
+void GraphWidget3D::buildLevels()
+{
+    m_levels.clear();
+    m_levelNsecs.clear();
+    m_level = 0;
+    HeightField level = m_surface;
+    while (qMax(level.xCount(), level.yCount()) > LOD_MIN_SIZE) {
+        level = level.halved();
+        m_levels.append(level);
+    }
+    m_levelNsecs.fill(0, m_levels.size() + 1);
+}
+
+void GraphWidget3D::recordFrame(int level, qint64 nsecs)
+{
+    if (level < m_levelNsecs.size())
+        m_levelNsecs[level] = nsecs;
+}
+
+// The finest level whose frame time fits in the frame budget; the
+// coarsest when none does. A level is taken to take as long as it last
+// did. A level not drawn yet is estimated as a fixed time per frame, for
+// the image, the tiles and the threads, plus a time per vertex, fitted to
+// the two levels nearest it that were drawn. With only one drawn, which
+// overstates the finer levels, the next finer level is drawn once if the
+// one drawn fits, for a second time to fit to.
+int GraphWidget3D::chooseLevel() const
+{
+    if (m_levels.isEmpty()) return 0;
+    int measured = 0;
+    for (qint64 nsecs : m_levelNsecs)
+        measured += nsecs > 0;
+    auto vertices = [&](int level) {
+        const HeightField &surface = level > 0 ? m_levels[level - 1] : m_surface;
+        return double(surface.xCount()) * surface.yCount();
+    };
+    auto estimate = [&](int level) {
+        if (m_levelNsecs[level] > 0) return double(m_levelNsecs[level]);
+        int nearest = -1, next = -1;
+        for (int l = 0; l < m_levelNsecs.size(); ++l) {
+            if (m_levelNsecs[l] == 0) continue;
+            if (nearest < 0 || qAbs(l - level) < qAbs(nearest - level)) {
+                next = nearest;
+                nearest = l;
+            } else if (next < 0 || qAbs(l - level) < qAbs(next - level)) {
+                next = l;
+            }
+        }
+        if (nearest < 0) return 0.0;
+        const double t = m_levelNsecs[nearest];
+        if (next >= 0) {
+            const double perVertex = (t - m_levelNsecs[next]) / (vertices(nearest) - vertices(next));
+            if (perVertex > 0)
+                return qMax(0.0, t + perVertex * (vertices(level) - vertices(nearest)));
+        }
+        return t * vertices(level) / vertices(nearest);
+    };
+    const double budget = m_frameBudgetMsecs * 1e6;
+    int level = 0;
+    while (level < m_levels.size() && estimate(level) > budget)
+        ++level;
+    if (measured == 1 && level > 0 && m_levelNsecs[level] > 0 && m_levelNsecs[level] <= budget)
+        --level;
+    return level;
+}
+
+void GraphWidget3D::fitZRange()
+{
+    if (m_autoZRange && m_hasSurface) {
+        m_zSketch.robustRange(m_autoZQuantile, &m_zMin, &m_zMax);
+        if (!(m_zMin <= m_zMax))
+            m_zMin = m_zMax = 0;
         double margin = (m_zMax - m_zMin) * 0.05 + 0.1;
         if (m_zMax - m_zMin < 0.01) margin = 1;
         m_zMin -= margin;
         m_zMax += margin;
     }
-    update();
 }
 
 void GraphWidget3D::setXRange(double xMin, double xMax)
 {
     m_xMin = xMin;
     m_xMax = xMax;
+    if (m_parser.isValid()) {
+        m_step = 0;
+        m_refineTimer.stop();
+    }
+    m_labelsStale = true;
     update();
 }
 
@@ -54,6 +254,11 @@ void GraphWidget3D::setYRange(double yMin, double yMax)
 {
     m_yMin = yMin;
     m_yMax = yMax;
+    if (m_parser.isValid()) {
+        m_step = 0;
+        m_refineTimer.stop();
+    }
+    m_labelsStale = true;
     update();
 }
 
@@ -62,56 +267,99 @@ void GraphWidget3D::setZRange(double zMin, double zMax)
     m_autoZRange = false;
     m_zMin = zMin;
     m_zMax = zMax;
+    m_labelsStale = true;
     update();
 }
 
 void GraphWidget3D::setSurfaceColor(const QColor &c)
 {
     m_surfaceColor = c;
+    m_rasterStale = true;
     update();
 }
 
 void GraphWidget3D::clear()
 {
-    m_grid.clear();
+    m_parser = ExpressionParser();
+    m_step = 0;
+    m_refineTimer.stop();
+    m_surface = HeightField();
+    m_levels.clear();
+    m_levelNsecs.clear();
+    m_level = 0;
     m_hasSurface = false;
     m_hasClickedPoint = false;
     m_autoZRange = true;
     m_zMin = -5;
     m_zMax = 5;
+    m_labelsStale = true;
     update();
 }
 
-QPointF GraphWidget3D::project(double x, double y, double z) const
+GraphWidget3D::Projection GraphWidget3D::projection() const
 {
-    const double cx = width() / 2.0;
-    const double cy = height() / 2.0;
+    Projection pr;
+    pr.cx = width() / 2.0;
+    pr.cy = height() / 2.0;
     double range = qMax(qMax(m_xMax - m_xMin, m_yMax - m_yMin), m_zMax - m_zMin);
     if (range < 1e-30) range = 1.0;
-    double scale = qMin(width(), height()) * 0.35 / range;
-    scale *= m_zoomFactor;
-
-    double ca = std::cos(m_azimuth), sa = std::sin(m_azimuth);
-    double ce = std::cos(m_elevation), se = std::sin(m_elevation);
-    double x1 = x * ca + y * sa;
-    double y1 = -x * sa + y * ca;
-    double z1 = z;
-    double y2 = y1 * ce + z1 * se;
-    double z2 = -y1 * se + z1 * ce;
-
-    double sx = cx + (x1 * scale);
-    double sy = cy - (y2 * scale);
+    pr.scale = qMin(width(), height()) * 0.35 / range * m_zoomFactor;
+    pr.ca = std::cos(m_azimuth);
+    pr.sa = std::sin(m_azimuth);
+    pr.ce = std::cos(m_elevation);
+    pr.se = std::sin(m_elevation);
+    return pr;
+}
+
+QPointF GraphWidget3D::project(double x, double y, double z) const
+{
+    const Projection pr = projection();
+    double x1 = x * pr.ca + y * pr.sa;
+    double y1 = -x * pr.sa + y * pr.ca;
+    double y2 = y1 * pr.ce + z * pr.se;
+
+    double sx = pr.cx + (x1 * pr.scale);
+    double sy = pr.cy - (y2 * pr.scale);
     return QPointF(sx, sy);
 }
 
-double GraphWidget3D::projectDepth(double x, double y, double z) const
+// Projects the vertices drawn, every drawnStep()-th of drawnSurface() in x
+// and y,
+// once for the frame, into the screen position and depth arrays that the
+// quads, the wireframe, the rasterizer and picking read. Depth is scaled
+// like the screen position, larger nearer. Along a row only y and z change,
+// so the part of the rotation that comes from x is worked out once per
+// row.
+void GraphWidget3D::updateProjection()
 {
-    double ca = std::cos(m_azimuth), sa = std::sin(m_azimuth);
-    double ce = std::cos(m_elevation), se = std::sin(m_elevation);
-    double x1 = x * ca + y * sa;
-    double y1 = -x * sa + y * ca;
-    double z1 = z;
-    return -y1 * std::sin(m_elevation) + z1 * std::cos(m_elevation);
+    const int nx = vertexCountX(), ny = vertexCountY();
+    const int count = nx * ny;
+    m_vertexX.resize(count);
+    m_vertexY.resize(count);
+    m_vertexDepth.resize(count);
+    if (count == 0) return;
+    const Projection pr = projection();
+    const HeightField &surface = drawnSurface();
+    const int step = drawnStep();
+    QVector<double> ys(ny);
+    for (int b = 0; b < ny; ++b)
+        ys[b] = surface.y(b * step);
+    for (int a = 0; a < nx; ++a) {
+        const int i = a * step;
+        const double x = surface.x(i);
+        const double xc = x * pr.ca, xs = -x * pr.sa;
+        const double *z = surface.constData() + qsizetype(i) * surface.yCount();
+        double *sx = m_vertexX.data() + a * ny;
+        double *sy = m_vertexY.data() + a * ny;
+        double *depth = m_vertexDepth.data() + a * ny;
+        for (int b = 0; b < ny; ++b) {
+            const double y1 = xs + ys[b] * pr.ca;
+            const double zb = z[b * step];
+            sx[b] = pr.cx + (xc + ys[b] * pr.sa) * pr.scale;
+            sy[b] = pr.cy - (y1 * pr.ce + zb * pr.se) * pr.scale;
+            depth[b] = (-y1 * pr.se + zb * pr.ce) * pr.scale;
+        }
+    }
 }
 
 QVector<double> GraphWidget3D::tickValues(double minVal, double maxVal, int maxTicks) const
@@ -239,95 +487,154 @@ QColor GraphWidget3D::colorForZWithBase(double z) const
     return QColor::fromHsl(h, s, lNew);
 }
 
+// Draws the quads back to front without sorting them. The view is an
+// orthographic one of a height field, so a quad can only hide quads
+// farther along the horizontal direction of view: going through the grid
+// from the far corner, in x outside and y inside, each one is drawn over
+// everything it may hide. Which corner is far follows from the signs of
+// the depth's slope in x and y.
 void GraphWidget3D::drawSurface(QPainter &p) const
 {
-    if (!m_hasSurface || m_grid.size() < 2 || m_grid.first().size() < 2)
+    if (!m_hasSurface || m_surface.xCount() < 2 || m_surface.yCount() < 2)
         return;
 
-    struct Quad {
-        QPolygonF screen;
-        double depth;
-        QColor color;
-    };
-    QVector<Quad> quads;
-
-    for (int i = 0; i < m_grid.size() - 1; ++i) {
-        for (int j = 0; j < m_grid[i].size() - 1; ++j) {
-            const Point3D &p00 = m_grid[i][j];
-            const Point3D &p10 = m_grid[i + 1][j];
-            const Point3D &p11 = m_grid[i + 1][j + 1];
-            const Point3D &p01 = m_grid[i][j + 1];
-            if (!std::isfinite(p00.z) || !std::isfinite(p10.z) || !std::isfinite(p11.z) || !std::isfinite(p01.z))
+    const Projection pr = projection();
+    const bool xForward = pr.se * pr.sa >= 0;
+    const bool yForward = -pr.se * pr.ca >= 0;
+
+    p.setRenderHint(QPainter::Antialiasing, true);
+    p.setRenderHint(QPainter::SmoothPixmapTransform, true);
+    p.setPen(QPen(palette().color(QPalette::Mid), 0.5));
+
+    const int nx = vertexCountX(), ny = vertexCountY();
+    QPointF corners[4];
+    for (int ia = 0; ia + 1 < nx; ++ia) {
+        const int a = xForward ? ia : nx - 2 - ia;
+        for (int ib = 0; ib + 1 < ny; ++ib) {
+            const int b = yForward ? ib : ny - 2 - ib;
+            const int v00 = a * ny + b, v10 = v00 + ny, v11 = v10 + 1, v01 = v00 + 1;
+            const double z00 = vertexZ(v00), z10 = vertexZ(v10), z11 = vertexZ(v11), z01 = vertexZ(v01);
+            if (!std::isfinite(z00) || !std::isfinite(z10) || !std::isfinite(z11) || !std::isfinite(z01))
                 continue;
-            double depth = (projectDepth(p00.x, p00.y, p00.z) + projectDepth(p10.x, p10.y, p10.z)
-                         + projectDepth(p11.x, p11.y, p11.z) + projectDepth(p01.x, p01.y, p01.z)) / 4;
-            double zMid = (p00.z + p10.z + p11.z + p01.z) / 4;
-            QColor quadColor = colorForZWithBase(zMid);
-            QPointF a = project(p00.x, p00.y, p00.z);
-            QPointF b = project(p10.x, p10.y, p10.z);
-            QPointF c = project(p11.x, p11.y, p11.z);
-            QPointF d = project(p01.x, p01.y, p01.z);
-            QPolygonF poly;
-            poly << a << b << c << d;
-            quads.append({ poly, depth, quadColor });
+            corners[0] = vertex(v00);
+            corners[1] = vertex(v10);
+            corners[2] = vertex(v11);
+            corners[3] = vertex(v01);
+            p.setBrush(colorForZWithBase((z00 + z10 + z11 + z01) / 4));
+            p.drawPolygon(corners, 4);
         }
     }
+}
 
-    std::sort(quads.begin(), quads.end(), [](const Quad &a, const Quad &b) { return a.depth < b.depth; });
+GraphWidget3D::RasterView GraphWidget3D::currentRasterView() const
+{
+    return { m_azimuth, m_elevation, m_zoomFactor, size(), devicePixelRatioF(), m_level, m_step,
+             m_xMin, m_xMax, m_yMin, m_yMax, m_zMin, m_zMax };
+}
 
-    p.setRenderHint(QPainter::Antialiasing, true);
-    p.setRenderHint(QPainter::SmoothPixmapTransform, true);
-    for (const Quad &q : quads) {
-        p.setBrush(q.color);
-        p.setPen(QPen(palette().color(QPalette::Mid), 0.5));
-        p.drawPolygon(q.screen);
+// Projects the surface for view and colours each cell by the mean height
+// of its corners, as drawSurface() does, from a table of COLOR_LEVELS
+// along the z range rather than one QColor per cell. SurfaceRasterizer
+// then draws it on m_rasterPool, and finishRaster() takes the image. The
+// time both parts take is the frame time chooseLevel() goes by.
+void GraphWidget3D::startRaster(const RasterView &view)
+{
+    QElapsedTimer timer;
+    timer.start();
+    m_rasterStale = false;
+    m_rasterBusy = true;
+    m_rasterView = view;
+    updateProjection();
+    const int nx = vertexCountX(), ny = vertexCountY();
+
+    QRgb levels[COLOR_LEVELS];
+    for (int k = 0; k < COLOR_LEVELS; ++k)
+        levels[k] = colorForZWithBase(m_zMin + (m_zMax - m_zMin) * k / (COLOR_LEVELS - 1)).rgb();
+    const double zSpan = m_zMax - m_zMin;
+    QVector<QRgb> colors(qMax(nx - 1, 0) * qMax(ny - 1, 0));
+    for (int a = 0; a + 1 < nx; ++a) {
+        for (int b = 0; b + 1 < ny; ++b) {
+            const int v = a * ny + b;
+            const double zMid = (vertexZ(v) + vertexZ(v + 1) + vertexZ(v + ny) + vertexZ(v + ny + 1)) / 4;
+            const double t = zSpan > 0 ? qBound(0.0, (zMid - m_zMin) / zSpan, 1.0) : 0;
+            colors[a * (ny - 1) + b] = std::isfinite(t) ? levels[qRound(t * (COLOR_LEVELS - 1))] : levels[0];
+        }
     }
+    const QVector<double> xs = m_vertexX, ys = m_vertexY, depths = m_vertexDepth;
+    const QRgb lineColor = palette().color(QPalette::WindowText).rgb();
+    const QRgb background = palette().color(QPalette::Base).rgb();
+    const qint64 prepareNsecs = timer.nsecsElapsed();
+
+    m_rasterPool.start([this, view, nx, ny, xs, ys, depths, colors, lineColor, background, prepareNsecs]() {
+        QElapsedTimer timer;
+        timer.start();
+        SurfaceRasterizer::Mesh mesh;
+        mesh.nx = nx;
+        mesh.ny = ny;
+        mesh.x = xs.constData();
+        mesh.y = ys.constData();
+        mesh.depth = depths.constData();
+        mesh.cellColors = colors.constData();
+        mesh.lineColor = lineColor;
+        mesh.lineWidth = qMax(1, qRound(0.8 * view.devicePixelRatio));
+        QImage image = m_rasterizer.render(mesh, view.size, view.devicePixelRatio, background);
+        image.setDevicePixelRatio(view.devicePixelRatio);
+        const qint64 nsecs = prepareNsecs + timer.nsecsElapsed();
+        QMetaObject::invokeMethod(this, [this, image, nsecs, view]() {
+            finishRaster(image, nsecs, view.level);
+        }, Qt::QueuedConnection);
+    });
+}
+
+void GraphWidget3D::finishRaster(const QImage &image, qint64 nsecs, int level)
+{
+    m_rasterBusy = false;
+    m_rasterImage = image;
+    recordFrame(level, nsecs);
+    update();
 }
 
 void GraphWidget3D::drawWireframe(QPainter &p) const
 {
-    if (!m_hasSurface || m_grid.size() < 2 || m_grid.first().size() < 2)
+    if (!m_hasSurface || m_surface.xCount() < 2 || m_surface.yCount() < 2)
         return;
 
     p.setPen(QPen(palette().color(QPalette::WindowText), 0.8));
     p.setBrush(Qt::NoBrush);
 
-    for (int i = 0; i < m_grid.size(); ++i) {
-        for (int j = 0; j < m_grid[i].size() - 1; ++j) {
-            const Point3D &a = m_grid[i][j];
-            const Point3D &b = m_grid[i][j + 1];
-            if (std::isfinite(a.z) && std::isfinite(b.z))
-                p.drawLine(project(a.x, a.y, a.z).toPoint(), project(b.x, b.y, b.z).toPoint());
+    const int nx = vertexCountX(), ny = vertexCountY();
+    for (int a = 0; a < nx; ++a) {
+        for (int b = 0; b + 1 < ny; ++b) {
+            const int v = a * ny + b;
+            if (std::isfinite(vertexZ(v)) && std::isfinite(vertexZ(v + 1)))
+                p.drawLine(vertex(v).toPoint(), vertex(v + 1).toPoint());
         }
     }
-    for (int j = 0; j < m_grid.first().size(); ++j) {
-        for (int i = 0; i < m_grid.size() - 1; ++i) {
-            const Point3D &a = m_grid[i][j];
-            const Point3D &b = m_grid[i + 1][j];
-            if (std::isfinite(a.z) && std::isfinite(b.z))
-                p.drawLine(project(a.x, a.y, a.z).toPoint(), project(b.x, b.y, b.z).toPoint());
+    for (int b = 0; b < ny; ++b) {
+        for (int a = 0; a + 1 < nx; ++a) {
+            const int v = a * ny + b;
+            if (std::isfinite(vertexZ(v)) && std::isfinite(vertexZ(v + ny)))
+                p.drawLine(vertex(v).toPoint(), vertex(v + ny).toPoint());
         }
     }
 }
 
 Point3D GraphWidget3D::pointAtScreen(QPoint screenPos) const
 {
-    if (!m_hasSurface || m_grid.isEmpty()) return Point3D();
+    if (!m_hasSurface || m_surface.isEmpty()) return Point3D();
 
     Point3D best;
     double bestDist = std::numeric_limits<double>::max();
 
-    for (const auto &row : m_grid) {
-        for (const Point3D &pt : row) {
-            if (!std::isfinite(pt.z)) continue;
-            QPointF proj = project(pt.x, pt.y, pt.z);
-            double dx = proj.x() - screenPos.x();
-            double dy = proj.y() - screenPos.y();
-            double d = dx * dx + dy * dy;
-            if (d < bestDist) {
-                bestDist = d;
-                best = pt;
-            }
+    const int ny = vertexCountY();
+    for (int v = 0; v < m_vertexX.size(); ++v) {
+        if (!std::isfinite(vertexZ(v))) continue;
+        double dx = m_vertexX[v] - screenPos.x();
+        double dy = m_vertexY[v] - screenPos.y();
+        double d = dx * dx + dy * dy;
+        if (d < bestDist) {
+            bestDist = d;
+            best = drawnSurface().point(v / ny * drawnStep(), v % ny * drawnStep());
         }
     }
     return best;
@@ -355,29 +662,63 @@ void GraphWidget3D::drawAxisLabels(QPainter &p) const
     QString yRange = QStringLiteral("y: %1 … %2").arg(m_yMin, 0, 'g', 3).arg(m_yMax, 0, 'g', 3);
     QString zRange = QStringLiteral("z: %1 … %2").arg(m_zMin, 0, 'g', 3).arg(m_zMax, 0, 'g', 3);
 
-    const int pad = 8;
-    QRect r(pad, pad, width() - 2 * pad, 48);
-    p.fillRect(r, QColor(255, 255, 255, 220));
+    QRect r(LABEL_PAD, LABEL_PAD, width() - 2 * LABEL_PAD, LABEL_HEIGHT);
+    QColor fill = palette().color(QPalette::Base);
+    fill.setAlpha(220);
+    p.fillRect(r, fill);
     p.drawRect(r);
     p.drawText(r.adjusted(4, 2, -4, -2), Qt::AlignLeft | Qt::AlignTop | Qt::TextWordWrap,
                xRange + QChar('\n') + yRange + QChar('\n') + zRange);
 }
 
+void GraphWidget3D::updateLabels()
+{
+    const qreal dpr = devicePixelRatio();
+    const QSize size = QSize(width(), LABEL_PAD + LABEL_HEIGHT + 1) * dpr;
+    if (!m_labelsStale && m_labels.size() == size && m_labels.devicePixelRatio() == dpr) return;
+    m_labelsStale = false;
+    m_labels = QPixmap(size);
+    m_labels.setDevicePixelRatio(dpr);
+    m_labels.fill(Qt::transparent);
+    QPainter p(&m_labels);
+    p.setFont(font());
+    drawAxisLabels(p);
+}
+
 void GraphWidget3D::paintEvent(QPaintEvent *event)
 {
     Q_UNUSED(event);
+    if (m_parser.isValid() && m_step == 0)
+        samplePass();
     QPainter p(this);
     p.fillRect(rect(), palette().color(QPalette::Base));
 
     if (m_hasSurface) {
-        drawSurface(p);
-        drawWireframe(p);
+        m_level = m_interacting ? chooseLevel() : 0;
+        if (m_renderer == RasterRenderer) {
+            const RasterView view = currentRasterView();
+            if (!m_rasterBusy && (m_rasterStale || view != m_rasterView))
+                startRaster(view);
+            if (!m_rasterImage.isNull())
+                p.drawImage(0, 0, m_rasterImage);
+        } else {
+            QElapsedTimer timer;
+            timer.start();
+            updateProjection();
+            drawSurface(p);
+            drawWireframe(p);
+            recordFrame(m_level, timer.nsecsElapsed());
+        }
         drawAxes3D(p);
+        updateLabels();
+        p.drawPixmap(0, 0, m_labels);
         drawClickedPoint(p);
     } else {
         p.setPen(palette().color(QPalette::PlaceholderText));
         p.drawText(rect(), Qt::AlignCenter, tr("Enter z = f(x,y) and click Graph in 3D mode"));
     }
+    if (m_step > 1)
+        m_refineTimer.start();
 }
 
 void GraphWidget3D::mousePressEvent(QMouseEvent *event)
@@ -385,6 +726,8 @@ void GraphWidget3D::mousePressEvent(QMouseEvent *event)
     if (event->button() == Qt::LeftButton) {
         m_lastMouse = event->position().toPoint();
         if (m_hasSurface) {
+            m_level = 0;
+            updateProjection();
             m_clickedPoint3D = pointAtScreen(m_lastMouse);
             m_hasClickedPoint = true;
             QString msg = tr("x = %1, y = %2, z = %3")
@@ -406,14 +749,34 @@ void GraphWidget3D::mouseMoveEvent(QMouseEvent *event)
     m_azimuth += delta.x() * 0.01;
     m_elevation += delta.y() * 0.01;
     m_elevation = qBound(-1.4, m_elevation, 1.4);
+    m_interacting = true;
+    m_idleTimer.start();
     update();
 }
 
+void GraphWidget3D::mouseReleaseEvent(QMouseEvent *event)
+{
+    if (event->button() == Qt::LeftButton)
+        endInteraction();
+}
+
+void GraphWidget3D::changeEvent(QEvent *event)
+{
+    if (event->type() == QEvent::PaletteChange || event->type() == QEvent::FontChange) {
+        m_labelsStale = true;
+        m_rasterStale = true;
+        update();
+    }
+    QWidget::changeEvent(event);
+}
+
 void GraphWidget3D::wheelEvent(QWheelEvent *event)
 {
     double factor = event->angleDelta().y() > 0 ? 1.15 : 1.0 / 1.15;
     m_zoomFactor *= factor;
     m_zoomFactor = qBound(0.1, m_zoomFactor, 20.0);
+    m_interacting = true;
+    m_idleTimer.start();
     update();
     event->accept();
 }
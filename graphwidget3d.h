@@ -1,14 +1,18 @@
 #ifndef GRAPHWIDGET3D_H
 #define GRAPHWIDGET3D_H
 
+#include "expressionparser.h"
+#include "heightfield.h"
+#include "quantilesketch.h"
+#include "surfacerasterizer.h"
 #include <QWidget>
 #include <QVector>
 #include <QPointF>
 #include <QColor>
-
-struct Point3D {
-    double x = 0, y = 0, z = 0;
-};
+#include <QPixmap>
+#include <QTimer>
+#include <QThreadPool>
+#include <QImage>
 
 class GraphWidget3D : public QWidget
 {
@@ -16,12 +20,24 @@ class GraphWidget3D : public QWidget
 
 public:
     explicit GraphWidget3D(QWidget *parent = nullptr);
+    ~GraphWidget3D() override;
 
-    void setSurface(const QVector<QVector<Point3D>> &grid);
+    // Plots the heights of surface, which is shared, not copied. Coarser
+    // levels of it, each with half the cells each way, are made once here
+    // for drawing while the view is dragged or zoomed.
+    void setSurface(const HeightField &surface);
+    // Plots z = f(x, y) for the parsed expression over the x and y ranges,
+    // on a grid of GRID_SIZE by GRID_SIZE cells. A coarse grid is shown
+    // first and refined in passes, painted in between, that only evaluate
+    // the points the last pass did not have, a frame's worth of rows at a
+    // time; setting another surface or range stops them.
+    void setExpression(const ExpressionParser &parser);
     void setXRange(double xMin, double xMax);
     void setYRange(double yMin, double yMax);
     void setZRange(double zMin, double zMax);
     void setAutoZRange(bool autoZ) { m_autoZRange = autoZ; }
+    // As GraphWidget::setAutoYQuantile(), for z. 0.005 by default.
+    void setAutoZQuantile(double q) { m_autoZQuantile = qBound(0.0, q, 0.5); }
     void setSurfaceColor(const QColor &c);
     QColor surfaceColor() const { return m_surfaceColor; }
     void clear();
@@ -31,20 +47,45 @@ public:
     void setAzimuth(double a) { m_azimuth = a; update(); }
     void setElevation(double e) { m_elevation = e; update(); }
 
+    // How the surface is drawn. RasterRenderer, the default, draws it in
+    // software with a depth buffer on all cores, off the GUI thread, right
+    // where the surface folds over itself; PainterRenderer draws the cells
+    // back to front with QPainter, antialiased.
+    enum Renderer { RasterRenderer, PainterRenderer };
+    void setRenderer(Renderer renderer) { m_renderer = renderer; m_rasterStale = true; update(); }
+    Renderer renderer() const { return m_renderer; }
+    // The time a frame may take while the view is dragged or zoomed,
+    // 16 ms by default. The finest level of the surface that the time the
+    // last frames took says fits is drawn, and the surface itself again
+    // once the view is released or has rested for IDLE_MSECS.
+    void setFrameBudget(int msecs) { m_frameBudgetMsecs = qMax(1, msecs); }
+    int frameBudget() const { return m_frameBudgetMsecs; }
+
     QSize minimumSizeHint() const override { return QSize(400, 300); }
 
 protected:
     void paintEvent(QPaintEvent *event) override;
     void mousePressEvent(QMouseEvent *event) override;
+    void mouseReleaseEvent(QMouseEvent *event) override;
     void mouseMoveEvent(QMouseEvent *event) override;
     void wheelEvent(QWheelEvent *event) override;
+    void changeEvent(QEvent *event) override;
+
+private slots:
+    void refine();
+    void endInteraction();
 
 private:
-    QVector<QVector<Point3D>> m_grid;
+    // The surface, of which every m_step-th point in x and y is drawn.
+    HeightField m_surface;
     double m_xMin = -5, m_xMax = 5;
     double m_yMin = -5, m_yMax = 5;
     double m_zMin = -5, m_zMax = 5;
     bool m_autoZRange = true;
+    double m_autoZQuantile = 0.005;
+    // The heights of the surface, for the automatic z range, counted as
+    // they are set or sampled.
+    QuantileSketch m_zSketch;
     bool m_hasSurface = false;
 
     double m_azimuth = 0.6;
@@ -53,20 +94,128 @@ private:
     QPoint m_lastMouse;
     QColor m_surfaceColor;
 
+    bool samplePass();
+    void fitZRange();
+    // The view transform: screen centre and scale, and the cosines and
+    // sines of the azimuth and elevation.
+    struct Projection {
+        double cx, cy, scale;
+        double ca, sa, ce, se;
+    };
+    Projection projection() const;
     QPointF project(double x, double y, double z) const;
-    double projectDepth(double x, double y, double z) const;
+    void updateProjection();
+    // The field drawn this frame and its step: m_surface and m_step, or
+    // level m_level of it, all of whose points are drawn.
+    const HeightField &drawnSurface() const { return m_level > 0 ? m_levels[m_level - 1] : m_surface; }
+    int drawnStep() const { return m_level > 0 ? 1 : m_step; }
+    int vertexCountX() const { return drawnStep() > 0 ? (drawnSurface().xCount() - 1) / drawnStep() + 1 : 0; }
+    int vertexCountY() const { return drawnStep() > 0 ? (drawnSurface().yCount() - 1) / drawnStep() + 1 : 0; }
+    QPointF vertex(int v) const { return QPointF(m_vertexX[v], m_vertexY[v]); }
+    double vertexZ(int v) const
+    {
+        const int ny = vertexCountY(), step = drawnStep();
+        return drawnSurface().z(v / ny * step, v % ny * step);
+    }
+    void buildLevels();
+    int chooseLevel() const;
+    void recordFrame(int level, qint64 nsecs);
     void drawSurface(QPainter &p) const;
     void drawWireframe(QPainter &p) const;
     void drawAxes3D(QPainter &p) const;
     void drawAxisLabels(QPainter &p) const;
+    void updateLabels();
     void drawClickedPoint(QPainter &p) const;
     QColor colorForZ(double z) const;
     QColor colorForZWithBase(double z) const;
     QVector<double> tickValues(double minVal, double maxVal, int maxTicks) const;
     Point3D pointAtScreen(QPoint screenPos) const;
 
+    // Screen position and depth of the vertices drawn, vertex a * ny + b
+    // being point (a * drawnStep(), b * drawnStep()) of drawnSurface()
+    // with ny = vertexCountY(); filled by updateProjection() for each
+    // frame.
+    QVector<double> m_vertexX;
+    QVector<double> m_vertexY;
+    QVector<double> m_vertexDepth;
+
+    Renderer m_renderer = RasterRenderer;
+
+    // What a raster image is drawn for. Any change of these, or
+    // m_rasterStale, which is set when the surface or its colours change,
+    // calls for a new image.
+    struct RasterView {
+        double azimuth, elevation, zoom;
+        QSize size;
+        qreal devicePixelRatio;
+        int level, step;
+        double xMin, xMax, yMin, yMax, zMin, zMax;
+        bool operator==(const RasterView &o) const
+        {
+            return azimuth == o.azimuth && elevation == o.elevation && zoom == o.zoom && size == o.size
+                && devicePixelRatio == o.devicePixelRatio && level == o.level && step == o.step
+                && xMin == o.xMin && xMax == o.xMax && yMin == o.yMin && yMax == o.yMax
+                && zMin == o.zMin && zMax == o.zMax;
+        }
+        bool operator!=(const RasterView &o) const { return !(*this == o); }
+    };
+    RasterView currentRasterView() const;
+    void startRaster(const RasterView &view);
+    void finishRaster(const QImage &image, qint64 nsecs, int level);
+
+    // The surface as SurfaceRasterizer last drew it, for m_rasterView,
+    // which paintEvent() blits until the next image is in. Images are
+    // drawn one at a time on m_rasterPool; a change meanwhile is drawn
+    // once the one under way is done.
+    QImage m_rasterImage;
+    RasterView m_rasterView = {};
+    bool m_rasterStale = true;
+    bool m_rasterBusy = false;
+    SurfaceRasterizer m_rasterizer;
+    QThreadPool m_rasterPool;
+
     bool m_hasClickedPoint = false;
     Point3D m_clickedPoint3D;
+
+    // The box with the ranges, at the screen's pixel density. It only
+    // changes with the ranges, the width and the palette, not with the
+    // view, so rotating does not lay out its text again.
+    QPixmap m_labels;
+    bool m_labelsStale = true;
+
+    // The expression, when the surface is sampled from one, into a field
+    // of GRID_SIZE + 1 points a side that is NaN where not evaluated yet.
+    // The step halves with each pass down to 1; 0 means nothing is
+    // sampled for the current ranges. The pass under way, run by
+    // m_refineTimer in chunks sized from the time the last one took to
+    // stay within about a frame, has its rows from m_nextRow on to go.
+    ExpressionParser m_parser;
+    int m_step = 0;
+    int m_nextRow = 0;
+    int m_pointBudget = MIN_PASS_POINTS;
+    QTimer m_refineTimer;
+
+    // Levels 1, 2, ... of a surface that was set, each halving the one
+    // before, down to about LOD_MIN_SIZE points a side; level 0 is the
+    // surface itself. While the view moves, the level drawn is picked from
+    // how long the frames of each level took, m_levelNsecs, 0 where none
+    // was drawn yet.
+    QVector<HeightField> m_levels;
+    int m_level = 0;
+    bool m_interacting = false;
+    QTimer m_idleTimer;
+    int m_frameBudgetMsecs = 16;
+    QVector<qint64> m_levelNsecs;
+
+    static const int GRID_SIZE = 80;
+    static const int COARSE_STEP = 8;
+    static const int MIN_PASS_POINTS = 32;
+    static const qint64 FRAME_NSECS = 12000000;
+    static const int COLOR_LEVELS = 256;
+    static const int LOD_MIN_SIZE = 32;
+    static const int IDLE_MSECS = 200;
+    static const int LABEL_PAD = 8;
+    static const int LABEL_HEIGHT = 48;
 };
 
 #endif // GRAPHWIDGET3D_H
@@ -0,0 +1,100 @@
+#ifndef HEIGHTFIELD_H
+#define HEIGHTFIELD_H
+
+#include <QVector>
+#include <QtGlobal>
+#include <QtMath>
+
+struct Point3D {
+    double x = 0, y = 0, z = 0;
+};
+
+// z over a regular grid of xCount by yCount points spanning [xMin, xMax]
+// in x and [yMin, yMax] in y. Only the heights are stored, in one block,
+// x-major: z(i, j) is at i * yCount() + j, the order evalGrid() writes in.
+// x and y follow from the indices. Copies share the block until one of
+// them is changed.
+//
+// Real is double, or float where half the memory is worth more than the
+// precision.
+template<typename Real>
+class BasicHeightField
+{
+public:
+    BasicHeightField() = default;
+    // A field with every height NaN.
+    BasicHeightField(int xCount, int yCount, double xMin, double xMax, double yMin, double yMax)
+        : m_z(qsizetype(qMax(xCount, 0)) * qMax(yCount, 0), Real(qQNaN()))
+        , m_xCount(qMax(xCount, 0))
+        , m_yCount(qMax(yCount, 0))
+        , m_xMin(xMin)
+        , m_xMax(xMax)
+        , m_yMin(yMin)
+        , m_yMax(yMax)
+    {
+    }
+
+    bool isEmpty() const { return m_z.isEmpty(); }
+    int xCount() const { return m_xCount; }
+    int yCount() const { return m_yCount; }
+    double xMin() const { return m_xMin; }
+    double xMax() const { return m_xMax; }
+    double yMin() const { return m_yMin; }
+    double yMax() const { return m_yMax; }
+
+    double x(int i) const { return m_xCount > 1 ? m_xMin + (m_xMax - m_xMin) * i / (m_xCount - 1) : m_xMin; }
+    double y(int j) const { return m_yCount > 1 ? m_yMin + (m_yMax - m_yMin) * j / (m_yCount - 1) : m_yMin; }
+    Real z(int i, int j) const { return m_z[qsizetype(i) * m_yCount + j]; }
+    void setZ(int i, int j, Real z) { m_z[qsizetype(i) * m_yCount + j] = z; }
+    Point3D point(int i, int j) const { return { x(i), y(j), double(z(i, j)) }; }
+
+    // The field with half as many cells each way, rounded up, over the
+    // same ranges: every other point where the cells divide evenly, heights
+    // interpolated linearly between neighbours where they do not.
+    BasicHeightField halved() const
+    {
+        const int xCount = m_xCount > 1 ? m_xCount / 2 + 1 : m_xCount;
+        const int yCount = m_yCount > 1 ? m_yCount / 2 + 1 : m_yCount;
+        BasicHeightField half(xCount, yCount, m_xMin, m_xMax, m_yMin, m_yMax);
+        // Index of point a of count in a row of n as a whole part and a
+        // fraction; the fraction is 0 on old points, which are taken as
+        // they are, NaN included.
+        auto locate = [](int a, int count, int n, int *whole, double *fraction) {
+            const double s = count > 1 ? double(a) * (n - 1) / (count - 1) : 0;
+            *whole = qMin(int(s), n - 1);
+            *fraction = s - *whole;
+        };
+        auto lerp = [](Real a, Real b, double t) { return t > 0 ? Real(a + (b - a) * t) : a; };
+        for (int a = 0; a < xCount; ++a) {
+            int i;
+            double u;
+            locate(a, xCount, m_xCount, &i, &u);
+            for (int b = 0; b < yCount; ++b) {
+                int j;
+                double v;
+                locate(b, yCount, m_yCount, &j, &v);
+                const int i1 = qMin(i + 1, m_xCount - 1), j1 = qMin(j + 1, m_yCount - 1);
+                half.setZ(a, b, lerp(lerp(z(i, j), z(i, j1), v), lerp(z(i1, j), z(i1, j1), v), u));
+            }
+        }
+        return half;
+    }
+
+    Real *data() { return m_z.data(); }
+    const Real *constData() const { return m_z.constData(); }
+    qsizetype size() const { return m_z.size(); }
+
+private:
+    QVector<Real> m_z;
+    int m_xCount = 0;
+    int m_yCount = 0;
+    double m_xMin = 0;
+    double m_xMax = 0;
+    double m_yMin = 0;
+    double m_yMax = 0;
+};
+
+using HeightField = BasicHeightField<double>;
+using HeightFieldF = BasicHeightField<float>;
+
+#endif // HEIGHTFIELD_H
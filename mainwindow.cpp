@@ -7,6 +7,7 @@
 #include <QComboBox>
 #include <QStackedWidget>
 #include <QPushButton>
+#include <QCheckBox>
 #include <QDoubleSpinBox>
 #include <QColorDialog>
 #include <QLabel>
@@ -23,6 +24,7 @@
 #include <QFile>
 #include <QFileInfo>
 #include <QIODevice>
+#include <cmath>
 
 MainWindow::MainWindow(QWidget *parent)
     : QMainWindow(parent)
@@ -34,7 +36,7 @@ MainWindow::MainWindow(QWidget *parent)
 
     QHBoxLayout *topRow = new QHBoxLayout;
     m_equationEdit = new QLineEdit(this);
-    m_equationEdit->setPlaceholderText(tr("2D: y = f(x) e.g. x^2, sin(x)"));
+    m_equationEdit->setPlaceholderText(tr("2D: y = f(x) e.g. x^2, sin(x); cos(x)"));
     m_equationEdit->setClearButtonEnabled(true);
     connect(m_equationEdit, &QLineEdit::textChanged, this, [this] { m_equationModified = true; });
     topRow->addWidget(m_equationEdit, 1);
@@ -113,6 +115,17 @@ MainWindow::MainWindow(QWidget *parent)
         m_colorButton->setStyleSheet(QStringLiteral("background-color: %1; min-width: 60px;").arg(initialColor.name()));
     connect(m_colorButton, &QPushButton::clicked, this, &MainWindow::chooseCurveColor);
     rangeRow->addWidget(m_colorButton);
+    m_derivativeCheck = new QCheckBox(tr("&Derivative"), this);
+    m_derivativeCheck->setToolTip(tr("Also plot f'(x) as a dashed curve (2D)"));
+    connect(m_derivativeCheck, &QCheckBox::toggled, this, [this] {
+        if (!m_equationEdit->text().trimmed().isEmpty())
+            drawGraph();
+    });
+    rangeRow->addWidget(m_derivativeCheck);
+    m_crosshairCheck = new QCheckBox(tr("C&rosshair"), this);
+    m_crosshairCheck->setToolTip(tr("Show x and f(x) under the mouse (2D)"));
+    connect(m_crosshairCheck, &QCheckBox::toggled, m_graphWidget, &GraphWidget::setCrosshairVisible);
+    rangeRow->addWidget(m_crosshairCheck);
     rangeRow->addStretch(1);
 
     layout->addLayout(rangeRow);
@@ -128,8 +141,10 @@ MainWindow::MainWindow(QWidget *parent)
 void MainWindow::onViewModeChanged(int index)
 {
     m_graphStack->setCurrentIndex(index);
+    m_derivativeCheck->setEnabled(index == 0);
+    m_crosshairCheck->setEnabled(index == 0);
     if (index == 0) {
-        m_equationEdit->setPlaceholderText(tr("2D: y = f(x) e.g. x^2, sin(x), 2*x+1"));
+        m_equationEdit->setPlaceholderText(tr("2D: y = f(x) e.g. x^2, sin(x); cos(x), separated by ;"));
     } else {
         m_equationEdit->setPlaceholderText(tr("3D: z = f(x,y) e.g. x^2+y^2, sin(sqrt(x^2+y^2))"));
     }
@@ -154,34 +169,42 @@ void MainWindow::drawGraph()
         return;
     }
 
-    ExpressionParser parser;
-    if (!parser.parse(expr)) {
-        QMessageBox::warning(this, tr("Invalid equation"),
-            tr("Could not parse equation: %1").arg(parser.errorString()));
-        return;
-    }
-
     if (m_viewModeCombo->currentIndex() == 0) {
-        const int numSamples = 2000;
+        // Several functions are separated by ';', each plotted in its own color.
+        QVector<ExpressionParser> parsers;
+        for (const QString &part : expr.split(QLatin1Char(';'), Qt::SkipEmptyParts)) {
+            const QString text = part.trimmed();
+            if (text.isEmpty()) continue;
+            ExpressionParser parser;
+            if (!parser.parse(text)) {
+                QMessageBox::warning(this, tr("Invalid equation"),
+                    tr("Could not parse equation %1: %2").arg(text, parser.errorString()));
+                return;
+            }
+            parsers.append(parser);
+        }
+        if (parsers.isEmpty()) {
+            QMessageBox::information(this, tr("Graph"), tr("Enter an equation first."));
+            return;
+        }
         double xMin = m_xMinSpin->value();
         double xMax = m_xMaxSpin->value();
         double yMin = m_yMinSpin->value();
         double yMax = m_yMaxSpin->value();
         if (xMin >= xMax) xMax = xMin + 1.0;
         if (yMin >= yMax) yMax = yMin + 1.0;
-        QVector<QPointF> samples;
-        samples.reserve(numSamples);
-        for (int i = 0; i <= numSamples; ++i) {
-            double x = xMin + (xMax - xMin) * i / numSamples;
-            double y = parser.eval(x);
-            samples.append(QPointF(x, y));
-        }
         m_graphWidget->setXRange(xMin, xMax);
         m_graphWidget->setYRange(yMin, yMax);
         m_graphWidget->setAutoYRange(false);
-        m_graphWidget->setSamples(samples);
+        m_graphWidget->setDerivativeVisible(m_derivativeCheck->isChecked());
+        m_graphWidget->setExpressions(parsers);
     } else {
-        const int gridSize = 80;
+        ExpressionParser parser;
+        if (!parser.parse(expr)) {
+            QMessageBox::warning(this, tr("Invalid equation"),
+                tr("Could not parse equation: %1").arg(parser.errorString()));
+            return;
+        }
         double xMin = m_xMinSpin->value();
         double xMax = m_xMaxSpin->value();
         double yMin = m_yMinSpin->value();
@@ -191,24 +214,11 @@ void MainWindow::drawGraph()
         if (xMin >= xMax) xMax = xMin + 1.0;
         if (yMin >= yMax) yMax = yMin + 1.0;
         if (zMin >= zMax) zMax = zMin + 1.0;
-        QVector<QVector<Point3D>> grid;
-        grid.reserve(gridSize + 1);
-        for (int i = 0; i <= gridSize; ++i) {
-            double x = xMin + (xMax - xMin) * i / gridSize;
-            QVector<Point3D> row;
-            row.reserve(gridSize + 1);
-            for (int j = 0; j <= gridSize; ++j) {
-                double y = yMin + (yMax - yMin) * j / gridSize;
-                double z = parser.eval(x, y);
-                row.append({ x, y, z });
-            }
-            grid.append(row);
-        }
         m_graphWidget3D->setXRange(xMin, xMax);
         m_graphWidget3D->setYRange(yMin, yMax);
         m_graphWidget3D->setZRange(zMin, zMax);
         m_graphWidget3D->setAutoZRange(false);
-        m_graphWidget3D->setSurface(grid);
+        m_graphWidget3D->setExpression(parser);
     }
 }
 
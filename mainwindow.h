@@ -8,6 +8,7 @@ class QComboBox;
 class QStackedWidget;
 class QDoubleSpinBox;
 class QPushButton;
+class QCheckBox;
 class GraphWidget;
 class GraphWidget3D;
 
@@ -49,6 +50,8 @@ private:
     QDoubleSpinBox *m_zMinSpin = nullptr;
     QDoubleSpinBox *m_zMaxSpin = nullptr;
     QPushButton *m_colorButton = nullptr;
+    QCheckBox *m_derivativeCheck = nullptr;
+    QCheckBox *m_crosshairCheck = nullptr;
     QStackedWidget *m_graphStack = nullptr;
     GraphWidget *m_graphWidget = nullptr;
     GraphWidget3D *m_graphWidget3D = nullptr;
@@ -0,0 +1,192 @@
+#include "nativecode.h"
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+#include <sys/mman.h>
+#include <unistd.h>
+#define KGRAPHER_NATIVE_CODE
+#endif
+
+// The generated function keeps the register array in rbx, the accumulator
+// in xmm0 and uses xmm1/xmm2 and rax as scratch. rbx is the only
+// callee-saved register touched; pushing it also leaves the stack 16-byte
+// aligned for calls into libm.
+
+NativeCode::NativeCode(int registerCount)
+    : m_constants(registerCount, 0), m_isConstant(registerCount, false)
+{
+    put({ 0x53 });                             // push rbx
+    put({ 0x48, 0x89, 0xfb });                 // mov rbx, rdi
+    put({ 0xf2, 0x0f, 0x11, 0x03 });           // movsd [rbx], xmm0
+    put({ 0xf2, 0x0f, 0x11, 0x4b, 0x08 });     // movsd [rbx + 8], xmm1
+    m_cached = 0;
+}
+
+NativeCode::~NativeCode()
+{
+#if defined(KGRAPHER_NATIVE_CODE)
+    if (m_page)
+        munmap(m_page, m_pageSize);
+#endif
+}
+
+bool NativeCode::isSupported()
+{
+#if defined(KGRAPHER_NATIVE_CODE)
+    return true;
+#else
+    return false;
+#endif
+}
+
+void NativeCode::setConstant(int reg, double value)
+{
+    m_constants[reg] = value;
+    m_isConstant[reg] = true;
+}
+
+void NativeCode::put(std::initializer_list<int> bytes)
+{
+    for (int b : bytes)
+        m_code.append(char(b));
+}
+
+void NativeCode::put64(quint64 v)
+{
+    for (int i = 0; i < 8; ++i)
+        m_code.append(char(v >> (8 * i)));
+}
+
+// ModRM and disp32 for [rbx + 8 * reg] with xmm as the register operand.
+void NativeCode::putMemoryOperand(int xmm, int reg)
+{
+    put({ 0x80 | (xmm << 3) | 3 });
+    const quint32 disp = quint32(reg * 8);
+    for (int i = 0; i < 4; ++i)
+        m_code.append(char(disp >> (8 * i)));
+}
+
+void NativeCode::setXmm(int xmm, quint64 bits)
+{
+    put({ 0x48, 0xb8 });                       // mov rax, imm64
+    put64(bits);
+    put({ 0x66, 0x48, 0x0f, 0x6e, 0xc0 | (xmm << 3) }); // movq xmm, rax
+}
+
+void NativeCode::loadInto(int xmm, int reg)
+{
+    if (m_isConstant[reg]) {
+        quint64 bits;
+        std::memcpy(&bits, &m_constants[reg], sizeof(bits));
+        setXmm(xmm, bits);
+    } else {
+        put({ 0xf2, 0x0f, 0x10 });             // movsd xmm, [rbx + disp32]
+        putMemoryOperand(xmm, reg);
+    }
+}
+
+void NativeCode::load(int reg)
+{
+    if (reg == m_cached) return;
+    loadInto(0, reg);
+    m_cached = reg;
+}
+
+void NativeCode::apply(Op op, int reg)
+{
+    static const int opcodes[] = { 0x58, 0x5c, 0x59, 0x5e }; // add, sub, mul, div
+    m_cached = -1;
+    if (op != Div && !m_isConstant[reg]) {
+        put({ 0xf2, 0x0f, opcodes[op] });      // opsd xmm0, [rbx + disp32]
+        putMemoryOperand(0, reg);
+        return;
+    }
+    loadInto(1, reg);
+    put({ 0xf2, 0x0f, opcodes[op], 0xc1 });    // opsd xmm0, xmm1
+    if (op != Div) return;
+    put({ 0x66, 0x0f, 0x57, 0xd2 });           // xorpd xmm2, xmm2
+    put({ 0x66, 0x0f, 0x2e, 0xca });           // ucomisd xmm1, xmm2
+    put({ 0x7a, 0x11 });                       // jp done (divisor is NaN)
+    put({ 0x75, 0x0f });                       // jne done
+    setXmm(0, 0x7ff8000000000000ULL);          // 15 bytes: xmm0 = NaN
+}
+
+void NativeCode::negate()
+{
+    m_cached = -1;
+    setXmm(1, 0x8000000000000000ULL);
+    put({ 0x66, 0x0f, 0x57, 0xc1 });           // xorpd xmm0, xmm1
+}
+
+void NativeCode::sqrt()
+{
+    m_cached = -1;
+    put({ 0xf2, 0x0f, 0x51, 0xc0 });           // sqrtsd xmm0, xmm0
+}
+
+void NativeCode::powInt(int exponent)
+{
+    m_cached = -1;
+    setXmm(1, 0x3ff0000000000000ULL);          // xmm1 = 1.0
+    for (int n = exponent; n; ) {
+        if (n & 1)
+            put({ 0xf2, 0x0f, 0x59, 0xc8 });   // mulsd xmm1, xmm0
+        n >>= 1;
+        if (n)
+            put({ 0xf2, 0x0f, 0x59, 0xc0 });   // mulsd xmm0, xmm0
+    }
+    put({ 0x66, 0x0f, 0x28, 0xc1 });           // movapd xmm0, xmm1
+}
+
+void NativeCode::call(UnaryFunction f)
+{
+    m_cached = -1;
+    put({ 0x48, 0xb8 });                       // mov rax, f
+    put64(quint64(reinterpret_cast<quintptr>(f)));
+    put({ 0xff, 0xd0 });                       // call rax
+}
+
+void NativeCode::call(BinaryFunction f, int reg)
+{
+    loadInto(1, reg);
+    m_cached = -1;
+    put({ 0x48, 0xb8 });                       // mov rax, f
+    put64(quint64(reinterpret_cast<quintptr>(f)));
+    put({ 0xff, 0xd0 });                       // call rax
+}
+
+void NativeCode::store(int reg)
+{
+    put({ 0xf2, 0x0f, 0x11 });                 // movsd [rbx + disp32], xmm0
+    putMemoryOperand(0, reg);
+    m_cached = reg;
+}
+
+bool NativeCode::finish()
+{
+#if defined(KGRAPHER_NATIVE_CODE)
+    put({ 0x5b });                             // pop rbx
+    put({ 0xc3 });                             // ret
+
+    // Never writable and executable at the same time: fill the pages
+    // first, then flip them. Systems that refuse PROT_EXEC on anonymous
+    // memory make mprotect fail, and the caller falls back.
+    const size_t page = size_t(sysconf(_SC_PAGESIZE));
+    const size_t size = (size_t(m_code.size()) + page - 1) / page * page;
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return false;
+    std::memcpy(p, m_code.constData(), size_t(m_code.size()));
+    if (mprotect(p, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(p, size);
+        return false;
+    }
+    m_page = p;
+    m_pageSize = size;
+    m_function = reinterpret_cast<Function>(p);
+    m_code.clear();
+    return true;
+#else
+    return false;
+#endif
+}
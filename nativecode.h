@@ -0,0 +1,64 @@
+#ifndef NATIVECODE_H
+#define NATIVECODE_H
+
+#include <QByteArray>
+#include <QVector>
+#include <cstddef>
+#include <initializer_list>
+
+// Builds an x86-64 function for an ExpressionParser program at runtime.
+// Every step works on an accumulator and on the caller's register array,
+// in the same order as the interpreter, so results are identical apart
+// from the sign bit of NaNs. The code is written into an anonymous
+// mapping that is switched from writable to executable once it is done;
+// where that is not possible finish() fails and the caller keeps
+// interpreting.
+class NativeCode
+{
+public:
+    // Stores x and y to regs[0] and regs[1] and returns the accumulator.
+    typedef double (*Function)(double x, double y, double *regs);
+    typedef double (*UnaryFunction)(double);
+    typedef double (*BinaryFunction)(double, double);
+    enum Op { Add, Sub, Mul, Div };
+
+    explicit NativeCode(int registerCount);
+    ~NativeCode();
+    NativeCode(const NativeCode &) = delete;
+    NativeCode &operator=(const NativeCode &) = delete;
+
+    // True when this build can map generated code on this platform.
+    static bool isSupported();
+
+    // Reads of reg become immediates instead of loads.
+    void setConstant(int reg, double value);
+
+    void load(int reg);
+    void apply(Op op, int reg); // Div gives NaN for a zero divisor
+    void negate();
+    void sqrt();                // NaN below zero, as sqrtsd does
+    void powInt(int exponent);  // same multiplications as scalarPowInt
+    void call(UnaryFunction f);
+    void call(BinaryFunction f, int reg);
+    void store(int reg);
+
+    bool finish();
+    Function function() const { return m_function; }
+
+private:
+    void put(std::initializer_list<int> bytes);
+    void put64(quint64 v);
+    void putMemoryOperand(int xmm, int reg);
+    void loadInto(int xmm, int reg);
+    void setXmm(int xmm, quint64 bits);
+
+    QByteArray m_code;
+    QVector<double> m_constants;
+    QVector<bool> m_isConstant;
+    int m_cached = -1; // register whose value the accumulator holds
+    void *m_page = nullptr;
+    size_t m_pageSize = 0;
+    Function m_function = nullptr;
+};
+
+#endif // NATIVECODE_H
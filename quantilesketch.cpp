@@ -0,0 +1,161 @@
+#include "quantilesketch.h"
+#include <QtMath>
+#include <cmath>
+#include <limits>
+
+QuantileSketch::QuantileSketch(double relativeError)
+{
+    const double e = qBound(1e-6, relativeError, 0.5);
+    m_gamma = (1 + e) / (1 - e);
+    m_logGamma = std::log(m_gamma);
+    clear();
+}
+
+void QuantileSketch::clear()
+{
+    m_positive = Store();
+    m_negative = Store();
+    m_zeros = 0;
+    m_count = 0;
+    m_min = qInf();
+    m_max = -qInf();
+}
+
+// Adds n to bucket index, growing the range of buckets as needed. Past
+// MaxBuckets, the buckets beyond are folded into the last one kept at
+// whichever end that bucket ends up with fewer values, the largest
+// magnitudes on a tie, so that a sparse tail goes before the bulk does.
+void QuantileSketch::Store::add(int index, qint64 n)
+{
+    if (counts.isEmpty()) {
+        first = index;
+        counts.append(n);
+        return;
+    }
+    if (index < first) {
+        counts.insert(0, first - index, qint64(0));
+        first = index;
+    } else if (index >= first + counts.size()) {
+        counts.resize(index - first + 1);
+    }
+    counts[index - first] += n;
+    const int excess = counts.size() - MaxBuckets;
+    if (excess <= 0) return;
+    qint64 low = 0, high = 0;
+    for (int i = 0; i <= excess; ++i) {
+        low += counts[i];
+        high += counts[counts.size() - 1 - i];
+    }
+    if (low < high) {
+        counts[excess] = low;
+        counts.remove(0, excess);
+        first += excess;
+    } else {
+        counts.resize(MaxBuckets);
+        counts.last() = high;
+    }
+}
+
+void QuantileSketch::Store::merge(const Store &other)
+{
+    for (int i = 0; i < other.counts.size(); ++i) {
+        if (other.counts[i] != 0)
+            add(other.first + i, other.counts[i]);
+    }
+}
+
+int QuantileSketch::bucket(double magnitude) const
+{
+    return int(std::ceil(std::log(magnitude) / m_logGamma));
+}
+
+// The value in the middle of bucket index, in relative terms, so within
+// the relative error of anything the bucket holds.
+double QuantileSketch::bucketValue(int index) const
+{
+    return std::exp(index * m_logGamma) * 2 / (m_gamma + 1);
+}
+
+void QuantileSketch::add(double value)
+{
+    if (!std::isfinite(value)) return;
+    ++m_count;
+    m_min = qMin(m_min, value);
+    m_max = qMax(m_max, value);
+    const double magnitude = std::abs(value);
+    if (magnitude < std::numeric_limits<double>::min())
+        ++m_zeros;
+    else if (value > 0)
+        m_positive.add(bucket(magnitude), 1);
+    else
+        m_negative.add(bucket(magnitude), 1);
+}
+
+void QuantileSketch::add(const double *values, int count)
+{
+    for (int i = 0; i < count; ++i)
+        add(values[i]);
+}
+
+void QuantileSketch::merge(const QuantileSketch &other)
+{
+    // Buckets of another gamma hold other ranges of values.
+    Q_ASSERT(m_gamma == other.m_gamma);
+    m_positive.merge(other.m_positive);
+    m_negative.merge(other.m_negative);
+    m_zeros += other.m_zeros;
+    m_count += other.m_count;
+    m_min = qMin(m_min, other.m_min);
+    m_max = qMax(m_max, other.m_max);
+}
+
+// Walks the buckets in increasing order of value: the negative ones from
+// the largest magnitude down, the zeros, then the positive ones.
+double QuantileSketch::quantile(double q) const
+{
+    if (m_count == 0) return qQNaN();
+    if (q <= 0) return m_min;
+    if (q >= 1) return m_max;
+    const double rank = q * (m_count - 1);
+    double value = m_max;
+    qint64 seen = 0;
+    bool found = false;
+    for (int i = m_negative.counts.size() - 1; i >= 0 && !found; --i) {
+        seen += m_negative.counts[i];
+        if (seen > rank) {
+            value = -bucketValue(m_negative.first + i);
+            found = true;
+        }
+    }
+    if (!found) {
+        seen += m_zeros;
+        if (seen > rank) {
+            value = 0;
+            found = true;
+        }
+    }
+    for (int i = 0; i < m_positive.counts.size() && !found; ++i) {
+        seen += m_positive.counts[i];
+        if (seen > rank) {
+            value = bucketValue(m_positive.first + i);
+            found = true;
+        }
+    }
+    return qBound(m_min, value, m_max);
+}
+
+void QuantileSketch::robustRange(double q, double *lo, double *hi) const
+{
+    if (m_count == 0) {
+        *lo = qInf();
+        *hi = -qInf();
+        return;
+    }
+    *lo = quantile(q);
+    *hi = quantile(1 - q);
+    const double width = *hi - *lo;
+    if (!(width > 0) || m_min >= *lo - width / 2)
+        *lo = m_min;
+    if (!(width > 0) || m_max <= *hi + width / 2)
+        *hi = m_max;
+}
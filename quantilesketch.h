@@ -0,0 +1,73 @@
+#ifndef QUANTILESKETCH_H
+#define QUANTILESKETCH_H
+
+#include <QVector>
+#include <QtGlobal>
+
+// Quantiles of a stream of values in bounded memory, for ranges that fit
+// the bulk of a function's values without being thrown by a few huge ones
+// near a pole. Values are counted in buckets whose bounds grow
+// geometrically, one set for each sign, so a quantile comes out within a
+// relative error of the value itself, whatever its magnitude. The buckets
+// of one sign span about 70 decades at the default error; past that, the
+// values at the end that holds fewer of them, usually a sparse tail, share
+// the last bucket there.
+//
+// Sketches of parts of the values, such as those of several threads or
+// several curves, merge into the sketch of all of them.
+class QuantileSketch
+{
+public:
+    // relativeError is the largest error of a quantile relative to its
+    // value, 2% by default, which is well within the margin of a range.
+    explicit QuantileSketch(double relativeError = 0.02);
+
+    // Counts value; values that are not finite are ignored.
+    void add(double value);
+    void add(const double *values, int count);
+    // Counts the values of other as well, which must have been made with
+    // the same relative error. The result is the sketch of all the values
+    // added to either, bucket for bucket, unless the buckets had to be
+    // folded: which end is folded then depends on the order.
+    void merge(const QuantileSketch &other);
+    void clear();
+
+    qint64 count() const { return m_count; }
+    bool isEmpty() const { return m_count == 0; }
+    double min() const { return m_min; }
+    double max() const { return m_max; }
+    // The value with a fraction q of the values below it, q in [0, 1];
+    // NaN when empty.
+    double quantile(double q) const;
+    // From quantile q to quantile 1 - q, stretched to min() and max() on a
+    // side where those lie within half the width of that range: the tail
+    // of a pole is cut off, the end of a curve that merely rises steeply
+    // kept. lo > hi when empty.
+    void robustRange(double q, double *lo, double *hi) const;
+
+    static const int MaxBuckets = 4096;
+
+private:
+    // Counts of buckets first to first + counts.size() - 1 of one sign,
+    // bucket i holding magnitudes in (gamma^(i - 1), gamma^i].
+    struct Store {
+        QVector<qint64> counts;
+        int first = 0;
+        void add(int index, qint64 n);
+        void merge(const Store &other);
+    };
+
+    int bucket(double magnitude) const;
+    double bucketValue(int index) const;
+
+    double m_gamma;
+    double m_logGamma;
+    Store m_positive;
+    Store m_negative; // by magnitude
+    qint64 m_zeros = 0;
+    qint64 m_count = 0;
+    double m_min;
+    double m_max;
+};
+
+#endif // QUANTILESKETCH_H
@@ -0,0 +1,290 @@
+#include "surfacerasterizer.h"
+#include <QThread>
+#include <QtMath>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <utility>
+
+namespace {
+
+// In double: the triangles of a steep surface near a pole reach far off
+// screen, where float has too few digits left for the pixels on it.
+struct ScreenVertex {
+    double x, y, depth;
+};
+
+// A tile being drawn: pixels x0 to x1 - 1 by y0 to y1 - 1 of the image,
+// with the depth of pixel (x, y) at (y - y0) * TileSize + x - x0.
+struct Tile {
+    int x0, y0, x1, y1;
+    QRgb *pixels;
+    qsizetype stride; // in pixels
+    float *depth;
+};
+
+// Twice the signed area of triangle a, b, p; as a function of p, zero on
+// the line through a and b.
+inline double edge(const ScreenVertex &a, const ScreenVertex &b, double px, double py)
+{
+    return (b.x - a.x) * (py - a.y) - (b.y - a.y) * (px - a.x);
+}
+
+// Fills the pixels of the tile whose centres lie in the triangle and
+// nearer than what is there already.
+void drawTriangle(Tile &tile, const ScreenVertex &p0, const ScreenVertex &p1, const ScreenVertex &p2, QRgb color)
+{
+    const double area = edge(p0, p1, p2.x, p2.y);
+    if (!(std::abs(area) > 0)) return;
+    const int xMin = int(qMax<double>(tile.x0, std::ceil(qMin(p0.x, qMin(p1.x, p2.x)) - 0.5)));
+    const int xMax = int(qMin<double>(tile.x1 - 1, std::floor(qMax(p0.x, qMax(p1.x, p2.x)) - 0.5)));
+    const int yMin = int(qMax<double>(tile.y0, std::ceil(qMin(p0.y, qMin(p1.y, p2.y)) - 0.5)));
+    const int yMax = int(qMin<double>(tile.y1 - 1, std::floor(qMax(p0.y, qMax(p1.y, p2.y)) - 0.5)));
+    if (xMin > xMax || yMin > yMax) return;
+
+    // Weights of the corners, each the area opposite it, made positive
+    // inside whichever way round the triangle is; they step by a constant
+    // from one pixel to the next in a row.
+    const double sign = area > 0 ? 1 : -1;
+    const double step0 = -(p2.y - p1.y) * sign;
+    const double step1 = -(p0.y - p2.y) * sign;
+    const double step2 = -(p1.y - p0.y) * sign;
+    const double invArea = 1 / std::abs(area);
+    for (int y = yMin; y <= yMax; ++y) {
+        const double cx = xMin + 0.5, cy = y + 0.5;
+        double w0 = edge(p1, p2, cx, cy) * sign;
+        double w1 = edge(p2, p0, cx, cy) * sign;
+        double w2 = edge(p0, p1, cx, cy) * sign;
+        QRgb *pixel = tile.pixels + y * tile.stride;
+        float *depth = tile.depth + (y - tile.y0) * SurfaceRasterizer::TileSize - tile.x0;
+        for (int x = xMin; x <= xMax; ++x) {
+            if (w0 >= 0 && w1 >= 0 && w2 >= 0) {
+                const float d = float((w0 * p0.depth + w1 * p1.depth + w2 * p2.depth) * invArea);
+                if (d > depth[x]) {
+                    depth[x] = d;
+                    pixel[x] = color;
+                }
+            }
+            w0 += step0;
+            w1 += step1;
+            w2 += step2;
+        }
+    }
+}
+
+// Draws the part of the line in the tile, width pixels wide, where it is
+// no more than tolerance behind what is there: a line on the surface is
+// sampled a little off the triangles under it. The line is first clipped
+// to the tile and a margin, then sampled at the middle of each pixel it
+// crosses along its longer axis, so that rounding cannot skip one.
+void drawLine(Tile &tile, const ScreenVertex &p0, const ScreenVertex &p1, QRgb color, int width, double tolerance)
+{
+    const double half = (width - 1) / 2.0;
+    const double dx = p1.x - p0.x, dy = p1.y - p0.y, dd = p1.depth - p0.depth;
+    double t0 = 0, t1 = 1;
+    auto clip = [&](double from, double delta, double lo, double hi) {
+        if (delta == 0) {
+            if (from < lo || from > hi) t1 = -1;
+            return;
+        }
+        const double a = (lo - from) / delta, b = (hi - from) / delta;
+        t0 = qMax(t0, qMin(a, b));
+        t1 = qMin(t1, qMax(a, b));
+    };
+    clip(p0.x, dx, tile.x0 - half - 1, tile.x1 + half);
+    clip(p0.y, dy, tile.y0 - half - 1, tile.y1 + half);
+    if (t0 > t1) return;
+
+    auto plot = [&](double t) {
+        const int left = int(std::floor(p0.x + t * dx - half));
+        const int top = int(std::floor(p0.y + t * dy - half));
+        const float d = float(p0.depth + t * dd + tolerance);
+        for (int y = qMax(top, tile.y0); y < qMin(top + width, tile.y1); ++y) {
+            QRgb *pixel = tile.pixels + y * tile.stride;
+            const float *depth = tile.depth + (y - tile.y0) * SurfaceRasterizer::TileSize - tile.x0;
+            for (int x = qMax(left, tile.x0); x < qMin(left + width, tile.x1); ++x) {
+                if (d >= depth[x])
+                    pixel[x] = color;
+            }
+        }
+    };
+    const bool steep = std::abs(dy) > std::abs(dx);
+    const double from = steep ? p0.y : p0.x, delta = steep ? dy : dx;
+    if (delta == 0) {
+        plot(t0);
+        return;
+    }
+    const double a = from + t0 * delta, b = from + t1 * delta;
+    const double lo = qMin(a, b), hi = qMax(a, b);
+    const int first = int(std::floor(lo)), last = int(std::floor(hi));
+    for (int c = first; c <= last; ++c) {
+        const double m = qBound(lo, c + 0.5, hi);
+        plot((m - from) / delta);
+    }
+}
+
+} // namespace
+
+SurfaceRasterizer::SurfaceRasterizer()
+{
+    // The thread that calls render() draws tiles too.
+    m_pool.setMaxThreadCount(qMax(1, QThread::idealThreadCount() - 1));
+}
+
+// Runs job(0) to job(count - 1) on the pool's threads and this one, each
+// taking the next job no other has taken, and returns when all are done.
+void SurfaceRasterizer::forEach(int count, const std::function<void(int)> &job)
+{
+    std::atomic<int> next(0);
+    auto work = [&] {
+        for (int i = next++; i < count; i = next++)
+            job(i);
+    };
+    const int helpers = qMin(count - 1, QThread::idealThreadCount() - 1);
+    for (int i = 0; i < helpers; ++i)
+        m_pool.start(work);
+    work();
+    m_pool.waitForDone();
+}
+
+QImage SurfaceRasterizer::render(const Mesh &mesh, QSize size, qreal devicePixelRatio, QRgb background)
+{
+    const QSize pixels = size * devicePixelRatio;
+    if (pixels.isEmpty()) return QImage();
+    QImage image(pixels, QImage::Format_ARGB32_Premultiplied);
+    image.fill(background);
+    if (mesh.nx < 2 || mesh.ny < 2) return image;
+
+    const int tilesX = (pixels.width() + TileSize - 1) / TileSize;
+    const int tilesY = (pixels.height() + TileSize - 1) / TileSize;
+    const int tileCount = tilesX * tilesY;
+    const int cellsX = mesh.nx - 1, cellsY = mesh.ny - 1;
+    const double scale = devicePixelRatio;
+
+    auto vertex = [&](int v) {
+        return ScreenVertex { mesh.x[v] * scale, mesh.y[v] * scale, mesh.depth[v] * scale };
+    };
+    // Vertices that are not finite are left out, and so are those beyond
+    // GuardBand pixels: there the edge functions of a triangle reaching
+    // back on screen have no precision left for its pixels.
+    auto isUsable = [&](int v) {
+        return std::abs(mesh.x[v] * scale) <= GuardBand && std::abs(mesh.y[v] * scale) <= GuardBand
+            && std::isfinite(mesh.depth[v]);
+    };
+    // A cell draws the lines from vertex (a, b) to (a + 1, b) and to
+    // (a, b + 1), and those along the far sides of the grid, so that each
+    // line is drawn once.
+    auto cellLines = [&](int a, int b, int ends[4][2]) {
+        const int v = a * mesh.ny + b;
+        int count = 0;
+        ends[count][0] = v;
+        ends[count++][1] = v + mesh.ny;
+        ends[count][0] = v;
+        ends[count++][1] = v + 1;
+        if (a + 1 == cellsX) {
+            ends[count][0] = v + mesh.ny;
+            ends[count++][1] = v + mesh.ny + 1;
+        }
+        if (b + 1 == cellsY) {
+            ends[count][0] = v + 1;
+            ends[count++][1] = v + mesh.ny + 1;
+        }
+        return count;
+    };
+
+    // Cells to the tiles their bounds overlap, by stripes of rows.
+    const int stripes = qMin(cellsX, 4 * QThread::idealThreadCount());
+    m_bins.resize(stripes * tileCount);
+    const double reach = mesh.lines ? (mesh.lineWidth + 1) / 2.0 : 0.0;
+    // Taken here: the workers must not detach the bins, which they share.
+    QVector<int> *allBins = m_bins.data();
+    forEach(stripes, [&](int stripe) {
+        QVector<int> *bins = allBins + stripe * tileCount;
+        for (int t = 0; t < tileCount; ++t)
+            bins[t].clear();
+        for (int a = stripe * cellsX / stripes; a < (stripe + 1) * cellsX / stripes; ++a) {
+            for (int b = 0; b < cellsY; ++b) {
+                const int v = a * mesh.ny + b;
+                double xMin = std::numeric_limits<double>::max(), xMax = -xMin;
+                double yMin = xMin, yMax = xMax;
+                auto include = [&](int w) {
+                    const ScreenVertex p = vertex(w);
+                    xMin = qMin(xMin, p.x);
+                    xMax = qMax(xMax, p.x);
+                    yMin = qMin(yMin, p.y);
+                    yMax = qMax(yMax, p.y);
+                };
+                if (isUsable(v) && isUsable(v + 1) && isUsable(v + mesh.ny) && isUsable(v + mesh.ny + 1)) {
+                    include(v);
+                    include(v + 1);
+                    include(v + mesh.ny);
+                    include(v + mesh.ny + 1);
+                } else if (mesh.lines) {
+                    int ends[4][2];
+                    const int count = cellLines(a, b, ends);
+                    for (int i = 0; i < count; ++i) {
+                        if (isUsable(ends[i][0]) && isUsable(ends[i][1])) {
+                            include(ends[i][0]);
+                            include(ends[i][1]);
+                        }
+                    }
+                }
+                if (xMax + reach < 0 || xMin - reach >= pixels.width() || yMax + reach < 0 || yMin - reach >= pixels.height())
+                    continue;
+                const int tx0 = int(qMax(0.0, std::floor((xMin - reach) / TileSize)));
+                const int tx1 = int(qMin(tilesX - 1.0, std::floor((xMax + reach) / TileSize)));
+                const int ty0 = int(qMax(0.0, std::floor((yMin - reach) / TileSize)));
+                const int ty1 = int(qMin(tilesY - 1.0, std::floor((yMax + reach) / TileSize)));
+                for (int ty = ty0; ty <= ty1; ++ty) {
+                    for (int tx = tx0; tx <= tx1; ++tx)
+                        bins[ty * tilesX + tx].append(a * cellsY + b);
+                }
+            }
+        }
+    });
+
+    // Each tile with the cells binned to it: first the surface, then the
+    // lines over it. A line on the surface lies up to about half a pixel
+    // off the triangles it is tested against; the tolerance covers that
+    // for all but faces seen nearly edge on.
+    QRgb *bits = reinterpret_cast<QRgb *>(image.bits());
+    const qsizetype stride = image.bytesPerLine() / qsizetype(sizeof(QRgb));
+    const double tolerance = 2 * scale;
+    forEach(tileCount, [&](int t) {
+        float depth[TileSize * TileSize];
+        std::fill(depth, depth + TileSize * TileSize, -std::numeric_limits<float>::infinity());
+        Tile tile;
+        tile.x0 = t % tilesX * TileSize;
+        tile.y0 = t / tilesX * TileSize;
+        tile.x1 = qMin(tile.x0 + TileSize, pixels.width());
+        tile.y1 = qMin(tile.y0 + TileSize, pixels.height());
+        tile.pixels = bits;
+        tile.stride = stride;
+        tile.depth = depth;
+        for (int stripe = 0; stripe < stripes; ++stripe) {
+            for (int cell : std::as_const(m_bins)[stripe * tileCount + t]) {
+                const int a = cell / cellsY, b = cell % cellsY;
+                const int v = a * mesh.ny + b;
+                if (!isUsable(v) || !isUsable(v + 1) || !isUsable(v + mesh.ny) || !isUsable(v + mesh.ny + 1))
+                    continue;
+                const ScreenVertex p00 = vertex(v), p01 = vertex(v + 1);
+                const ScreenVertex p10 = vertex(v + mesh.ny), p11 = vertex(v + mesh.ny + 1);
+                drawTriangle(tile, p00, p10, p11, mesh.cellColors[cell]);
+                drawTriangle(tile, p00, p11, p01, mesh.cellColors[cell]);
+            }
+        }
+        if (!mesh.lines) return;
+        for (int stripe = 0; stripe < stripes; ++stripe) {
+            for (int cell : std::as_const(m_bins)[stripe * tileCount + t]) {
+                int ends[4][2];
+                const int count = cellLines(cell / cellsY, cell % cellsY, ends);
+                for (int i = 0; i < count; ++i) {
+                    if (isUsable(ends[i][0]) && isUsable(ends[i][1]))
+                        drawLine(tile, vertex(ends[i][0]), vertex(ends[i][1]), mesh.lineColor, mesh.lineWidth, tolerance);
+                }
+            }
+        }
+    });
+    return image;
+}
@@ -0,0 +1,60 @@
+#ifndef SURFACERASTERIZER_H
+#define SURFACERASTERIZER_H
+
+#include <QColor>
+#include <QImage>
+#include <QSize>
+#include <QThreadPool>
+#include <QVector>
+#include <functional>
+
+// Draws the projected grid of a height field into an image, in software:
+// each cell as two triangles tested against a depth buffer, so that what
+// is nearest shows whatever the order and however the surface folds over
+// itself, then the grid lines where the surface does not hide them.
+//
+// The image is cut into tiles drawn in parallel, one thread to a tile,
+// each with its own part of the depth buffer. A first parallel pass sorts
+// the cells into the tiles their bounds overlap, so that a tile only
+// looks at the cells that may cover it.
+class SurfaceRasterizer
+{
+public:
+    // nx by ny vertices, vertex a * ny + b, each with a position on screen
+    // and a depth in the same units, larger nearer. Vertices that are not
+    // finite, or with a coordinate beyond GuardBand pixels of the image,
+    // are left out with the cells and lines they belong to.
+    struct Mesh {
+        int nx = 0;
+        int ny = 0;
+        const double *x = nullptr;
+        const double *y = nullptr;
+        const double *depth = nullptr;
+        // Colour of cell a * (ny - 1) + b, the one from vertex (a, b) to
+        // vertex (a + 1, b + 1).
+        const QRgb *cellColors = nullptr;
+        bool lines = true;
+        QRgb lineColor = 0xff000000;
+        int lineWidth = 1; // in pixels of the image
+    };
+
+    SurfaceRasterizer();
+
+    // The mesh over a background, in an image of size times
+    // devicePixelRatio pixels; the mesh is in units of size.
+    QImage render(const Mesh &mesh, QSize size, qreal devicePixelRatio, QRgb background);
+
+    static const int TileSize = 64;
+    static constexpr double GuardBand = 1e7;
+
+private:
+    void forEach(int count, const std::function<void(int)> &job);
+
+    QThreadPool m_pool;
+    // The cells of each stripe of rows of cells that overlap each tile,
+    // stripe * tile count + tile, kept from frame to frame for their
+    // capacity.
+    QVector<QVector<int>> m_bins;
+};
+
+#endif // SURFACERASTERIZER_H
@@ -0,0 +1,146 @@
+#include "vectormath.h"
+#include <QtGlobal>
+#include <QByteArray>
+#include <cmath>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#endif
+
+namespace VectorMath {
+
+#if defined(__SSE2__) || defined(_M_X64)
+const Kernels &sse2Kernels();
+#define KGRAPHER_HAVE_SSE2_KERNELS
+#endif
+#if defined(KGRAPHER_HAVE_AVX2)
+const Kernels &avx2Kernels();
+#endif
+
+double scalarSin(double x) { return std::sin(x); }
+double scalarCos(double x) { return std::cos(x); }
+double scalarTan(double x) { return std::tan(x); }
+double scalarExp(double x) { return std::exp(x); }
+double scalarLog(double x) { return x <= 0 ? qQNaN() : std::log(x); }
+double scalarPow(double x, double y) { return std::pow(x, y); }
+double scalarPowInt(double x, int n)
+{
+    double r = 1;
+    for (;;) {
+        if (n & 1) r *= x;
+        n >>= 1;
+        if (!n) return r;
+        x *= x;
+    }
+}
+
+namespace {
+
+void addScalar(const double *a, const double *b, double *r, int n)
+{
+    for (int i = 0; i < n; ++i) r[i] = a[i] + b[i];
+}
+void subScalar(const double *a, const double *b, double *r, int n)
+{
+    for (int i = 0; i < n; ++i) r[i] = a[i] - b[i];
+}
+void mulScalar(const double *a, const double *b, double *r, int n)
+{
+    for (int i = 0; i < n; ++i) r[i] = a[i] * b[i];
+}
+void divScalar(const double *a, const double *b, double *r, int n)
+{
+    for (int i = 0; i < n; ++i) r[i] = b[i] == 0 ? qQNaN() : a[i] / b[i];
+}
+void powScalar(const double *a, const double *b, double *r, int n)
+{
+    for (int i = 0; i < n; ++i) r[i] = std::pow(a[i], b[i]);
+}
+void powIntScalar(const double *a, int exponent, double *r, int n)
+{
+    for (int i = 0; i < n; ++i) r[i] = scalarPowInt(a[i], exponent);
+}
+void negateScalar(const double *a, double *r, int n)
+{
+    for (int i = 0; i < n; ++i) r[i] = -a[i];
+}
+void sqrtScalar(const double *a, double *r, int n)
+{
+    for (int i = 0; i < n; ++i) r[i] = a[i] < 0 ? qQNaN() : std::sqrt(a[i]);
+}
+void sinScalar(const double *a, double *r, int n)
+{
+    for (int i = 0; i < n; ++i) r[i] = std::sin(a[i]);
+}
+void cosScalar(const double *a, double *r, int n)
+{
+    for (int i = 0; i < n; ++i) r[i] = std::cos(a[i]);
+}
+void tanScalar(const double *a, double *r, int n)
+{
+    for (int i = 0; i < n; ++i) r[i] = std::tan(a[i]);
+}
+void expScalar(const double *a, double *r, int n)
+{
+    for (int i = 0; i < n; ++i) r[i] = std::exp(a[i]);
+}
+void logScalar(const double *a, double *r, int n)
+{
+    for (int i = 0; i < n; ++i) r[i] = scalarLog(a[i]);
+}
+
+bool cpuHasAvx2()
+{
+#if defined(KGRAPHER_HAVE_AVX2) && (defined(__GNUC__) || defined(__clang__))
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#elif defined(KGRAPHER_HAVE_AVX2) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return false;
+    __cpuid(info, 1);
+    const bool fma = info[2] & (1 << 12);
+    const bool osxsave = info[2] & (1 << 27);
+    if (!fma || !osxsave || (_xgetbv(0) & 0x6) != 0x6) return false;
+    __cpuidex(info, 7, 0);
+    return info[1] & (1 << 5);
+#else
+    return false;
+#endif
+}
+
+const Kernels *pickKernels()
+{
+    const QByteArray forced = qgetenv("KGRAPHER_SIMD");
+    if (forced == "scalar")
+        return &scalarKernels();
+#if defined(KGRAPHER_HAVE_AVX2)
+    if (forced != "sse2" && cpuHasAvx2())
+        return &avx2Kernels();
+#endif
+#if defined(KGRAPHER_HAVE_SSE2_KERNELS)
+    return &sse2Kernels();
+#else
+    return &scalarKernels();
+#endif
+}
+
+} // namespace
+
+const Kernels &scalarKernels()
+{
+    static const Kernels k = {
+        "scalar",
+        addScalar, subScalar, mulScalar, divScalar, powScalar, powIntScalar,
+        negateScalar, sqrtScalar, sinScalar, cosScalar, tanScalar, expScalar, logScalar
+    };
+    return k;
+}
+
+const Kernels &kernels()
+{
+    static const Kernels *k = pickKernels();
+    return *k;
+}
+
+} // namespace VectorMath
@@ -0,0 +1,51 @@
+#ifndef VECTORMATH_H
+#define VECTORMATH_H
+
+// Column kernels behind ExpressionParser::evalBatch. Each kernel reads n
+// values from its operand columns and writes n results. Arithmetic and sqrt
+// are exact; exp/log may differ from libm in the last bit or two, and
+// sin/cos by up to 2^-52, which is many ulps of a result near zero.
+// Division by zero, log of x <= 0 and sqrt of x < 0 give NaN, as in eval().
+namespace VectorMath {
+
+typedef void (*UnaryKernel)(const double *a, double *r, int n);
+typedef void (*BinaryKernel)(const double *a, const double *b, double *r, int n);
+typedef void (*PowIntKernel)(const double *a, int exponent, double *r, int n);
+
+struct Kernels {
+    const char *name;
+    BinaryKernel add;
+    BinaryKernel sub;
+    BinaryKernel mul;
+    BinaryKernel div;
+    BinaryKernel pow;
+    PowIntKernel powInt;
+    UnaryKernel negate;
+    UnaryKernel sqrt;
+    UnaryKernel sin;
+    UnaryKernel cos;
+    UnaryKernel tan;
+    UnaryKernel exp;
+    UnaryKernel log;
+};
+
+// Best kernel set for the running CPU, chosen on first use. Setting
+// KGRAPHER_SIMD to "scalar", "sse2" or "avx2" overrides the choice.
+const Kernels &kernels();
+
+// Plain loops over the scalar functions; also used for lanes the vector
+// approximations do not cover.
+const Kernels &scalarKernels();
+double scalarSin(double x);
+double scalarCos(double x);
+double scalarTan(double x);
+double scalarExp(double x);
+double scalarLog(double x);
+double scalarPow(double x, double y);
+// x^n for n >= 0 by square-and-multiply. Agrees with std::pow on NaN, inf
+// and zero operands; finite results may differ in the last bits.
+double scalarPowInt(double x, int n);
+
+} // namespace VectorMath
+
+#endif // VECTORMATH_H
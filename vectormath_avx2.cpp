@@ -0,0 +1,52 @@
+#include "vectormath.h"
+
+// Built with AVX2/FMA code generation (see CMakeLists.txt); only reached
+// after VectorMath::kernels() has checked the CPU supports both.
+#if defined(KGRAPHER_HAVE_AVX2)
+
+#include <immintrin.h>
+#include "vectormath_simd.h"
+
+namespace {
+
+struct Avx2
+{
+    typedef __m256d V;
+    enum { Width = 4 };
+
+    static V load(const double *p) { return _mm256_loadu_pd(p); }
+    static void store(double *p, V v) { _mm256_storeu_pd(p, v); }
+    static V set1(double d) { return _mm256_set1_pd(d); }
+    static V bits(long long b) { return _mm256_castsi256_pd(_mm256_set1_epi64x(b)); }
+    static V add(V a, V b) { return _mm256_add_pd(a, b); }
+    static V sub(V a, V b) { return _mm256_sub_pd(a, b); }
+    static V mul(V a, V b) { return _mm256_mul_pd(a, b); }
+    static V div(V a, V b) { return _mm256_div_pd(a, b); }
+    static V madd(V a, V b, V c) { return _mm256_fmadd_pd(a, b, c); }
+    static V sqrt(V a) { return _mm256_sqrt_pd(a); }
+    static V bitAnd(V a, V b) { return _mm256_and_pd(a, b); }
+    static V bitOr(V a, V b) { return _mm256_or_pd(a, b); }
+    static V bitXor(V a, V b) { return _mm256_xor_pd(a, b); }
+    static V andNot(V a, V b) { return _mm256_andnot_pd(a, b); }
+    static V eq(V a, V b) { return _mm256_cmp_pd(a, b, _CMP_EQ_OQ); }
+    static V lt(V a, V b) { return _mm256_cmp_pd(a, b, _CMP_LT_OQ); }
+    static V le(V a, V b) { return _mm256_cmp_pd(a, b, _CMP_LE_OQ); }
+    static V select(V m, V a, V b) { return _mm256_blendv_pd(b, a, m); }
+    static int mask(V m) { return _mm256_movemask_pd(m); }
+    static V shiftLeft52(V a) { return _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_castpd_si256(a), 52)); }
+    static V shiftRight52(V a) { return _mm256_castsi256_pd(_mm256_srli_epi64(_mm256_castpd_si256(a), 52)); }
+};
+
+} // namespace
+
+namespace VectorMath {
+
+const Kernels &avx2Kernels()
+{
+    static const Kernels k = SimdKernels<Avx2>::table("avx2");
+    return k;
+}
+
+} // namespace VectorMath
+
+#endif
@@ -0,0 +1,262 @@
+#ifndef VECTORMATH_SIMD_H
+#define VECTORMATH_SIMD_H
+
+// Vector kernels written once against a small traits type (see
+// vectormath_sse2.cpp and vectormath_avx2.cpp). Only include this from a
+// translation unit compiled for the matching instruction set, and keep
+// everything here internal to it: an inline function emitted with AVX2
+// enabled must never be picked by the linker for a baseline caller.
+
+#include "vectormath.h"
+
+namespace {
+
+template<typename S>
+struct SimdKernels
+{
+    typedef typename S::V V;
+
+    static V abs(V x) { return S::andNot(S::bits(0x8000000000000000LL), x); }
+
+    // Exact for |x| < 2^51, which every caller guarantees.
+    static V round(V x)
+    {
+        const V magic = S::set1(6755399441055744.0);
+        return S::sub(S::add(x, magic), magic);
+    }
+    static V floor(V x)
+    {
+        V r = round(x);
+        return S::select(S::lt(x, r), S::sub(r, S::set1(1.0)), r);
+    }
+
+    template<typename Fast>
+    static void unary(const double *a, double *r, int n, Fast fast, double (*slow)(double))
+    {
+        int i = 0;
+        for (; i + S::Width <= n; i += S::Width) {
+            int bad = 0;
+            S::store(r + i, fast(S::load(a + i), bad));
+            if (bad) {
+                for (int l = 0; l < S::Width; ++l)
+                    if (bad & (1 << l)) r[i + l] = slow(a[i + l]);
+            }
+        }
+        for (; i < n; ++i) {
+            double in[S::Width] = {}, out[S::Width];
+            in[0] = a[i];
+            int bad = 0;
+            S::store(out, fast(S::load(in), bad));
+            r[i] = (bad & 1) ? slow(a[i]) : out[0];
+        }
+    }
+
+    template<typename Op>
+    static void binary(const double *a, const double *b, double *r, int n, Op op)
+    {
+        int i = 0;
+        for (; i + S::Width <= n; i += S::Width)
+            S::store(r + i, op(S::load(a + i), S::load(b + i)));
+        for (; i < n; ++i) {
+            double ia[S::Width] = {}, ib[S::Width] = {}, out[S::Width];
+            ia[0] = a[i];
+            ib[0] = b[i];
+            S::store(out, op(S::load(ia), S::load(ib)));
+            r[i] = out[0];
+        }
+    }
+
+    static void add(const double *a, const double *b, double *r, int n)
+    {
+        binary(a, b, r, n, [](V x, V y) { return S::add(x, y); });
+    }
+    static void sub(const double *a, const double *b, double *r, int n)
+    {
+        binary(a, b, r, n, [](V x, V y) { return S::sub(x, y); });
+    }
+    static void mul(const double *a, const double *b, double *r, int n)
+    {
+        binary(a, b, r, n, [](V x, V y) { return S::mul(x, y); });
+    }
+    static void div(const double *a, const double *b, double *r, int n)
+    {
+        binary(a, b, r, n, [](V x, V y) {
+            return S::select(S::eq(y, S::set1(0.0)), S::bits(0x7ff8000000000000LL), S::div(x, y));
+        });
+    }
+
+    // Squares are by far the most common power in typed expressions and
+    // x * x is correctly rounded; other exponents go through libm.
+    static void pow(const double *a, const double *b, double *r, int n)
+    {
+        const V two = S::set1(2.0);
+        int i = 0;
+        for (; i + S::Width <= n; i += S::Width) {
+            const V x = S::load(a + i);
+            if (S::mask(S::eq(S::load(b + i), two)) == (1 << S::Width) - 1) {
+                S::store(r + i, S::mul(x, x));
+            } else {
+                for (int l = 0; l < S::Width; ++l)
+                    r[i + l] = VectorMath::scalarPow(a[i + l], b[i + l]);
+            }
+        }
+        for (; i < n; ++i)
+            r[i] = VectorMath::scalarPow(a[i], b[i]);
+    }
+
+    // Same multiplications in the same order as scalarPowInt, so the
+    // results match it bit for bit.
+    static void powInt(const double *a, int exponent, double *r, int n)
+    {
+        unary(a, r, n, [exponent](V x, int &) {
+            V result = S::set1(1.0);
+            for (int e = exponent;;) {
+                if (e & 1) result = S::mul(result, x);
+                e >>= 1;
+                if (!e) return result;
+                x = S::mul(x, x);
+            }
+        }, nullptr);
+    }
+
+    static void negate(const double *a, double *r, int n)
+    {
+        unary(a, r, n, [](V x, int &) { return S::bitXor(x, S::bits(0x8000000000000000LL)); }, nullptr);
+    }
+    static void sqrt(const double *a, double *r, int n)
+    {
+        unary(a, r, n, [](V x, int &) {
+            return S::select(S::lt(x, S::set1(0.0)), S::bits(0x7ff8000000000000LL), S::sqrt(x));
+        }, nullptr);
+    }
+
+    // Cephes exp: e^x = 2^n * e^r with |r| <= ln2/2, e^r from a Pade form.
+    static V expFast(V x, int &bad)
+    {
+        const V ok = S::le(abs(x), S::set1(708.0));
+        bad = ~S::mask(ok) & ((1 << S::Width) - 1);
+        x = S::select(ok, x, S::set1(0.0));
+
+        const V n = round(S::mul(x, S::set1(1.4426950408889634073599)));
+        x = S::sub(x, S::mul(n, S::set1(6.93145751953125E-1)));
+        x = S::sub(x, S::mul(n, S::set1(1.42860682030941723212E-6)));
+        const V xx = S::mul(x, x);
+        V p = S::madd(xx, S::set1(1.26177193074810590878E-4), S::set1(3.02994407707441961300E-2));
+        p = S::mul(x, S::madd(p, xx, S::set1(9.99999999999999999910E-1)));
+        V q = S::madd(xx, S::set1(3.00198505138664455042E-6), S::set1(2.52448340349684104192E-3));
+        q = S::madd(q, xx, S::set1(2.27265548208155028766E-1));
+        q = S::madd(q, xx, S::set1(2.00000000000000000009E0));
+        const V e = S::madd(S::set1(2.0), S::div(p, S::sub(q, p)), S::set1(1.0));
+
+        // 2^n: put n + 1023 into the low mantissa bits, then shift it up
+        // into the exponent field.
+        const V biased = S::add(n, S::set1(4503599627370496.0 + 1023.0));
+        return S::mul(e, S::shiftLeft52(biased));
+    }
+
+    // fdlibm log: x = 2^k * m with m in [sqrt(1/2), sqrt(2)), then a
+    // minimax series in s = (m - 1) / (m + 1).
+    static V logFast(V x, int &bad)
+    {
+        const V ok = S::bitAnd(S::le(S::set1(2.2250738585072014e-308), x),
+                               S::lt(x, S::bits(0x7ff0000000000000LL)));
+        bad = ~S::mask(ok) & ((1 << S::Width) - 1);
+        x = S::select(ok, x, S::set1(1.0));
+
+        const V twoTo52 = S::set1(4503599627370496.0);
+        V k = S::sub(S::sub(S::bitOr(S::shiftRight52(x), twoTo52), twoTo52), S::set1(1022.0));
+        V m = S::bitOr(S::bitAnd(x, S::bits(0x000fffffffffffffLL)), S::bits(0x3fe0000000000000LL));
+        const V small = S::lt(m, S::set1(0.70710678118654752440));
+        m = S::select(small, S::add(m, m), m);
+        k = S::select(small, S::sub(k, S::set1(1.0)), k);
+
+        const V f = S::sub(m, S::set1(1.0));
+        const V s = S::div(f, S::add(S::set1(2.0), f));
+        const V z = S::mul(s, s);
+        const V w = S::mul(z, z);
+        V t1 = S::madd(w, S::set1(1.531383769920937332e-01), S::set1(2.222219843214978396e-01));
+        t1 = S::mul(w, S::madd(t1, w, S::set1(3.999999999940941908e-01)));
+        V t2 = S::madd(w, S::set1(1.479819860511658591e-01), S::set1(1.818357216161805012e-01));
+        t2 = S::madd(t2, w, S::set1(2.857142874366239149e-01));
+        t2 = S::mul(z, S::madd(t2, w, S::set1(6.666666666666735130e-01)));
+        const V rr = S::add(t2, t1);
+        const V hfsq = S::mul(S::set1(0.5), S::mul(f, f));
+        const V inner = S::madd(k, S::set1(1.90821492927058770002e-10), S::mul(s, S::add(hfsq, rr)));
+        return S::sub(S::mul(k, S::set1(6.93147180369123816490e-01)), S::sub(S::sub(hfsq, inner), f));
+    }
+
+    // Cephes sin/cos: reduce by multiples of pi/4 in three parts, then pick
+    // the sine or cosine polynomial and the sign from the octant.
+    static V sinCosFast(V x, int &bad, bool cosine)
+    {
+        const V ok = S::le(abs(x), S::set1(1048576.0));
+        bad = ~S::mask(ok) & ((1 << S::Width) - 1);
+        x = S::select(ok, x, S::set1(0.0));
+
+        const V signBit = S::bits(0x8000000000000000LL);
+        const V ax = abs(x);
+        const V q = floor(S::mul(ax, S::set1(1.27323954473516268615)));
+        const V y = S::mul(S::set1(2.0), floor(S::mul(S::add(q, S::set1(1.0)), S::set1(0.5))));
+        V j = S::sub(y, S::mul(S::set1(8.0), floor(S::mul(y, S::set1(0.125)))));
+
+        V z = S::sub(ax, S::mul(y, S::set1(7.85398125648498535156E-1)));
+        z = S::sub(z, S::mul(y, S::set1(3.77489470793079817668E-8)));
+        z = S::sub(z, S::mul(y, S::set1(2.69515142907905952645E-15)));
+        const V zz = S::mul(z, z);
+
+        V ps = S::madd(zz, S::set1(1.58962301576546568060E-10), S::set1(-2.50507477628578072866E-8));
+        ps = S::madd(ps, zz, S::set1(2.75573136213857245213E-6));
+        ps = S::madd(ps, zz, S::set1(-1.98412698295895385996E-4));
+        ps = S::madd(ps, zz, S::set1(8.33333333332211858878E-3));
+        ps = S::madd(ps, zz, S::set1(-1.66666666666666307295E-1));
+        const V sinPoly = S::madd(S::mul(z, zz), ps, z);
+
+        V pc = S::madd(zz, S::set1(-1.13585365213876817300E-11), S::set1(2.08757008419747316778E-9));
+        pc = S::madd(pc, zz, S::set1(-2.75573141792967388112E-7));
+        pc = S::madd(pc, zz, S::set1(2.48015872888517045348E-5));
+        pc = S::madd(pc, zz, S::set1(-1.38888888888730564116E-3));
+        pc = S::madd(pc, zz, S::set1(4.16666666666665929218E-2));
+        const V cosPoly = S::madd(S::mul(zz, zz), pc, S::sub(S::set1(1.0), S::mul(S::set1(0.5), zz)));
+
+        const V upper = S::lt(S::set1(3.0), j);
+        j = S::select(upper, S::sub(j, S::set1(4.0)), j);
+        const V two = S::eq(j, S::set1(2.0));
+        V sign = S::bitAnd(upper, signBit);
+        V r;
+        if (cosine) {
+            sign = S::bitXor(sign, S::bitAnd(two, signBit));
+            r = S::select(two, sinPoly, cosPoly);
+        } else {
+            sign = S::bitXor(sign, S::bitAnd(x, signBit));
+            r = S::select(two, cosPoly, sinPoly);
+        }
+        return S::bitXor(r, sign);
+    }
+
+    static void exp(const double *a, double *r, int n)
+    {
+        unary(a, r, n, expFast, VectorMath::scalarExp);
+    }
+    static void log(const double *a, double *r, int n)
+    {
+        unary(a, r, n, logFast, VectorMath::scalarLog);
+    }
+    static void sin(const double *a, double *r, int n)
+    {
+        unary(a, r, n, [](V x, int &bad) { return sinCosFast(x, bad, false); }, VectorMath::scalarSin);
+    }
+    static void cos(const double *a, double *r, int n)
+    {
+        unary(a, r, n, [](V x, int &bad) { return sinCosFast(x, bad, true); }, VectorMath::scalarCos);
+    }
+
+    static VectorMath::Kernels table(const char *name)
+    {
+        const VectorMath::Kernels &scalar = VectorMath::scalarKernels();
+        return { name, add, sub, mul, div, pow, powInt, negate, sqrt, sin, cos, scalar.tan, exp, log };
+    }
+};
+
+} // namespace
+
+#endif // VECTORMATH_SIMD_H
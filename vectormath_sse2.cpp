@@ -0,0 +1,50 @@
+#include "vectormath.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+
+#include <emmintrin.h>
+#include "vectormath_simd.h"
+
+namespace {
+
+struct Sse2
+{
+    typedef __m128d V;
+    enum { Width = 2 };
+
+    static V load(const double *p) { return _mm_loadu_pd(p); }
+    static void store(double *p, V v) { _mm_storeu_pd(p, v); }
+    static V set1(double d) { return _mm_set1_pd(d); }
+    static V bits(long long b) { return _mm_castsi128_pd(_mm_set1_epi64x(b)); }
+    static V add(V a, V b) { return _mm_add_pd(a, b); }
+    static V sub(V a, V b) { return _mm_sub_pd(a, b); }
+    static V mul(V a, V b) { return _mm_mul_pd(a, b); }
+    static V div(V a, V b) { return _mm_div_pd(a, b); }
+    static V madd(V a, V b, V c) { return _mm_add_pd(_mm_mul_pd(a, b), c); }
+    static V sqrt(V a) { return _mm_sqrt_pd(a); }
+    static V bitAnd(V a, V b) { return _mm_and_pd(a, b); }
+    static V bitOr(V a, V b) { return _mm_or_pd(a, b); }
+    static V bitXor(V a, V b) { return _mm_xor_pd(a, b); }
+    static V andNot(V a, V b) { return _mm_andnot_pd(a, b); }
+    static V eq(V a, V b) { return _mm_cmpeq_pd(a, b); }
+    static V lt(V a, V b) { return _mm_cmplt_pd(a, b); }
+    static V le(V a, V b) { return _mm_cmple_pd(a, b); }
+    static V select(V m, V a, V b) { return _mm_or_pd(_mm_and_pd(m, a), _mm_andnot_pd(m, b)); }
+    static int mask(V m) { return _mm_movemask_pd(m); }
+    static V shiftLeft52(V a) { return _mm_castsi128_pd(_mm_slli_epi64(_mm_castpd_si128(a), 52)); }
+    static V shiftRight52(V a) { return _mm_castsi128_pd(_mm_srli_epi64(_mm_castpd_si128(a), 52)); }
+};
+
+} // namespace
+
+namespace VectorMath {
+
+const Kernels &sse2Kernels()
+{
+    static const Kernels k = SimdKernels<Sse2>::table("sse2");
+    return k;
+}
+
+} // namespace VectorMath
+
+#endif